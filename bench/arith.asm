@@ -0,0 +1,18 @@
+; arith: register-only ALU loop, 1000 x 5000 iterations of ADD/NOT/AND
+; and a conditional branch. Exercises dispatch and condition codes.
+.ORIG x3000
+        AND R0, R0, #0      ; checksum
+        LD R1, OUTER
+OLOOP   LD R2, INNER
+ILOOP   ADD R0, R0, R2
+        NOT R3, R0
+        AND R3, R3, R2
+        ADD R0, R0, R3
+        ADD R2, R2, #-1
+        BRp ILOOP
+        ADD R1, R1, #-1
+        BRp OLOOP
+        HALT
+OUTER   .FILL #1000
+INNER   .FILL #5000
+.END
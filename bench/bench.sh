@@ -0,0 +1,108 @@
+#!/bin/sh
+# usage: bench/bench.sh [--runs=N] [--baseline=FILE] [--threshold=PCT]
+#
+# Builds lc3.c with each dispatch engine (and with eager condition codes,
+# -DLC3_EAGER_FLAGS, as goto-eager/jit-eager, and with --intrinsics, as
+# goto-native/jit-native), runs every benchmark program under each of them
+# and prints one JSON object per program and engine (best of --runs, default
+# 3). With --baseline=FILE, a saved earlier output, every result is compared
+# against it and the script exits 1 if any MIPS figure dropped by more than
+# --threshold percent (default 10). Where perf_event_open gives access to
+# hardware counters, each result also carries host instructions, branch
+# misses and L1d misses per guest instruction.
+set -e
+
+runs=3
+baseline=
+threshold=10
+for arg in "$@"; do
+    case $arg in
+        --runs=*) runs=${arg#*=} ;;
+        --baseline=*) baseline=${arg#*=} ;;
+        --threshold=*) threshold=${arg#*=} ;;
+        *) echo "unknown option: $arg" >&2; exit 2 ;;
+    esac
+done
+
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+$CC $CFLAGS -pthread "$here/../lc3.c" -o "$work/lc3-goto"
+$CC $CFLAGS -pthread -DLC3_SWITCH_DISPATCH "$here/../lc3.c" -o "$work/lc3-switch"
+$CC $CFLAGS -pthread -DLC3_EAGER_FLAGS "$here/../lc3.c" -o "$work/lc3-eager"
+engines="goto switch goto-eager goto-native"
+if [ "$(uname -m)" = x86_64 ]; then
+    engines="$engines jit jit-eager jit-native"
+fi
+
+# 2048: a fixed pseudo-random game, then moves and 'n' until it is over
+awk 'BEGIN {
+    s = 1; printf "y"
+    for (i = 0; i < 3000; ++i) { s = s * 75 % 65537; printf "%sy", substr("wasd", s % 4 + 1, 1) }
+    for (i = 0; i < 2000; ++i) printf "wasdn"
+}' > "$work/2048.txt"
+: > "$work/empty.txt"
+
+programs="arith memcpy fib puts mathlib 2048"
+
+# run_one program engine: best-of-$runs stats as "instructions seconds syscalls
+# host-instructions branch-misses l1d-misses", the last three per guest
+# instruction or null where the host has no hardware counters
+run_one() {
+    image=$here/$1.obj input=$work/empty.txt
+    if [ "$1" = 2048 ]; then
+        image=$here/../2048.obj input=$work/2048.txt
+    fi
+    case $2 in
+        goto) set -- "$work/lc3-goto" ;;
+        switch) set -- "$work/lc3-switch" ;;
+        jit) set -- "$work/lc3-goto" --jit ;;
+        goto-eager) set -- "$work/lc3-eager" ;;
+        jit-eager) set -- "$work/lc3-eager" --jit ;;
+        goto-native) set -- "$work/lc3-goto" --intrinsics ;;
+        jit-native) set -- "$work/lc3-goto" --jit --intrinsics ;;
+    esac
+    i=0
+    while [ $i -lt "$runs" ]; do
+        "$@" --stats "$image" < "$input" > /dev/null 2> "$work/stats"
+        awk -F': ' 'BEGIN { hi = bm = l1 = "null" }
+                    $1 == "instructions" { n = $2 } $1 == "seconds" { t = $2 } $1 == "syscalls" { s = $2 }
+                    $1 == "host instructions/instruction" { hi = $2 }
+                    $1 == "host branch-misses/instruction" { bm = $2 }
+                    $1 == "host L1d-misses/instruction" { l1 = $2 }
+                    END { print n, t, s, hi, bm, l1 }' "$work/stats"
+        i=$((i + 1))
+    done | sort -g -k2 | head -n 1
+}
+
+for program in $programs; do
+    for engine in $engines; do
+        run_one "$program" "$engine" | awk -v p="$program" -v e="$engine" '{
+            printf "{\"program\": \"%s\", \"engine\": \"%s\", \"instructions\": %s, \"seconds\": %s, ", p, e, $1, $2
+            printf "\"mips\": %.2f, \"ns_per_instruction\": %.3f, ", $1 / $2 / 1e6, $2 * 1e9 / $1
+            printf "\"syscalls\": %s, \"syscalls_per_sec\": %.0f, ", $3, $3 / $2
+            printf "\"host_instructions_per_instruction\": %s, \"branch_misses_per_instruction\": %s, ", $4, $5
+            printf "\"l1d_misses_per_instruction\": %s}\n", $6
+        }'
+    done
+done | tee "$work/results.json"
+
+if [ -n "$baseline" ]; then
+    awk -v limit="$threshold" '
+        function field(line, name,    m) {
+            match(line, "\"" name "\": \"?[^,\"}]*")
+            m = substr(line, RSTART, RLENGTH); sub(/.*: "?/, "", m); return m
+        }
+        FNR == NR { base[field($0, "program") "/" field($0, "engine")] = field($0, "mips"); next }
+        {
+            key = field($0, "program") "/" field($0, "engine")
+            if (!(key in base)) next
+            change = (field($0, "mips") - base[key]) * 100 / base[key]
+            printf "%-16s %10.2f -> %10.2f MIPS (%+.1f%%)\n", key, base[key], field($0, "mips"), change > "/dev/stderr"
+            if (change < -limit) failed = 1
+        }
+        END { exit failed }' "$baseline" "$work/results.json"
+fi
@@ -0,0 +1,32 @@
+; fib: naive recursive fib(20) with a stack in R6, 100 times.
+; Exercises JSR/RET and stack traffic.
+.ORIG x3000
+        LD R6, STACK
+        LD R5, REPS
+RLOOP   LD R0, N
+        JSR FIB
+        ADD R5, R5, #-1
+        BRp RLOOP
+        HALT
+STACK   .FILL x8000
+REPS    .FILL #100
+N       .FILL #20
+FIB     ADD R1, R0, #-2     ; R0 = fib(R0)
+        BRn FDONE
+        ADD R6, R6, #-1
+        STR R7, R6, #0
+        ADD R6, R6, #-1
+        STR R0, R6, #0      ; push n
+        ADD R0, R0, #-1
+        JSR FIB
+        LDR R1, R6, #0
+        STR R0, R6, #0      ; replace n with fib(n-1)
+        ADD R0, R1, #-2
+        JSR FIB
+        LDR R1, R6, #0
+        ADD R0, R0, R1
+        ADD R6, R6, #1
+        LDR R7, R6, #0
+        ADD R6, R6, #1
+FDONE   RET
+.END
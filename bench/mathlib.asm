@@ -0,0 +1,200 @@
+; mathlib: the routines --intrinsics recognises, each called in a loop, 5000 times.
+; MUL and DIVMOD are copied word for word from 2048.obj (x32E3 and x32CF);
+; the others are the library's own. All of them keep a stack in R6 and
+; restore the registers they do not return a result in.
+.ORIG x3000
+        LD R6, STACK
+        LD R5, REPS
+RLOOP   LD R0, SEED         ; seed = seed * 75 mod 30011
+        LD R1, MULT
+        JSR MUL
+        LD R1, MODULUS
+        JSR DIVMOD
+        ST R0, SEED
+        AND R1, R0, #7      ; (seed << (seed & 7) >> (seed & 7)) / 10, printed
+        JSR LSHIFT
+        JSR RSHIFT
+        AND R1, R1, #0
+        ADD R1, R1, #10
+        JSR DIVMOD
+        ADD R0, R1, #0
+        JSR PRINTD
+        LD R0, NEWLINE
+        OUT
+        LD R0, DST          ; copy 500 words
+        LD R1, SRC
+        LD R2, LEN
+        JSR MEMCPY
+        ADD R5, R5, #-1
+        BRp RLOOP
+        HALT
+STACK   .FILL x8000
+REPS    .FILL #5000
+SEED    .FILL #1
+MULT    .FILL #75
+MODULUS .FILL #30011
+NEWLINE .FILL x0A
+SRC     .FILL x4000
+DST     .FILL x5000
+LEN     .FILL #500
+
+MUL     ADD R0, R0, #0      ; R0 = (R0 & x7FFF) * R1
+        BRz MULZERO
+        ADD R1, R1, #0
+        BRz MULZERO
+        STR R1, R6, #-1
+        STR R2, R6, #-2
+        STR R3, R6, #-3
+        STR R4, R6, #-4
+        ADD R6, R6, #-4
+        AND R2, R2, #0
+        ADD R3, R2, #1
+MULBIT  AND R4, R0, R3
+        BRnz MULNEXT
+        ADD R2, R2, R1
+MULNEXT ADD R1, R1, R1
+        ADD R3, R3, R3
+        BRp MULBIT
+        ADD R0, R2, #0
+        LDR R4, R6, #0
+        LDR R3, R6, #1
+        LDR R2, R6, #2
+        LDR R1, R6, #3
+        ADD R6, R6, #4
+        RET
+MULZERO AND R0, R0, #0
+        RET
+
+DIVMOD  STR R1, R6, #-1     ; R0 = R0 mod R1, R1 = R0 / R1, for R0 > 0
+        STR R2, R6, #-2
+        STR R3, R6, #-3
+        ADD R6, R6, #-3
+        NOT R2, R1
+        ADD R2, R2, #1
+        BRz DIVZERO
+        AND R1, R1, #0
+DIVLOOP ADD R1, R1, #1
+        ADD R0, R0, R2
+        BRp DIVLOOP
+        BRz DIVDONE
+        LDR R2, R6, #2
+        ADD R1, R1, #-1
+        ADD R0, R0, R2
+DIVDONE LDR R3, R6, #0
+        LDR R2, R6, #1
+        ADD R6, R6, #3
+        RET
+DIVZERO HALT                ; division by zero
+
+LSHIFT  STR R1, R6, #-1     ; R0 = R0 << R1
+        ADD R6, R6, #-1
+        ADD R1, R1, #0
+        BRnz LSDONE
+LSLOOP  ADD R0, R0, R0
+        ADD R1, R1, #-1
+        BRp LSLOOP
+LSDONE  LDR R1, R6, #0
+        ADD R6, R6, #1
+        RET
+
+RSHIFT  STR R1, R6, #-1     ; R0 = R0 >> R1, shifting in zeros
+        STR R2, R6, #-2
+        STR R3, R6, #-3
+        STR R4, R6, #-4
+        ADD R6, R6, #-4
+        AND R2, R2, #0      ; R2 = result
+        AND R3, R3, #0
+        ADD R3, R3, #1      ; R3 = source bit
+        ADD R1, R1, #0
+        BRnz RSBITS
+RSSKIP  ADD R3, R3, R3
+        BRz RSDONE          ; everything shifted out
+        ADD R1, R1, #-1
+        BRp RSSKIP
+RSBITS  AND R1, R1, #0
+        ADD R1, R1, #1      ; R1 = result bit
+RSBIT   AND R4, R0, R3
+        BRz RSNEXT
+        ADD R2, R2, R1
+RSNEXT  ADD R1, R1, R1
+        ADD R3, R3, R3
+        BRnp RSBIT
+RSDONE  ADD R0, R2, #0
+        LDR R4, R6, #0
+        LDR R3, R6, #1
+        LDR R2, R6, #2
+        LDR R1, R6, #3
+        ADD R6, R6, #4
+        RET
+
+PRINTD  STR R7, R6, #-1     ; prints R0 as a signed decimal number
+        STR R4, R6, #-2
+        STR R3, R6, #-3
+        STR R2, R6, #-4
+        STR R1, R6, #-5
+        STR R0, R6, #-6
+        ADD R6, R6, #-6
+        ADD R1, R0, #0      ; R1 = what is left to print
+        BRzp PDPOS
+        LD R0, PDMINUS
+        OUT
+        NOT R1, R1
+        ADD R1, R1, #1
+PDPOS   LEA R2, PDTENS      ; R2 = next power of ten, negated
+        AND R4, R4, #0      ; R4 = sum of the digits so far
+PDDIGIT LDR R3, R2, #0
+        BRz PDLAST
+        AND R0, R0, #0
+PDSUB   ADD R1, R1, R3
+        BRn PDOUT
+        ADD R0, R0, #1
+        BR PDSUB
+PDOUT   NOT R3, R3
+        ADD R3, R3, #1
+        ADD R1, R1, R3      ; undo the last subtraction
+        ADD R4, R4, R0
+        BRz PDNEXT          ; no leading zeros
+        LD R3, PDZERO
+        ADD R0, R0, R3
+        OUT
+PDNEXT  ADD R2, R2, #1
+        BR PDDIGIT
+PDLAST  LD R3, PDZERO
+        ADD R0, R1, R3
+        OUT
+        LDR R0, R6, #0
+        LDR R1, R6, #1
+        LDR R2, R6, #2
+        LDR R3, R6, #3
+        LDR R4, R6, #4
+        LDR R7, R6, #5
+        ADD R6, R6, #6
+        RET
+PDMINUS .FILL x2D
+PDZERO  .FILL x30
+PDTENS  .FILL #-10000
+        .FILL #-1000
+        .FILL #-100
+        .FILL #-10
+        .FILL #0
+
+MEMCPY  STR R0, R6, #-1     ; copies R2 words from R1 up to R0, lowest first
+        STR R1, R6, #-2
+        STR R2, R6, #-3
+        STR R3, R6, #-4
+        ADD R6, R6, #-4
+        ADD R2, R2, #0
+        BRnz MCDONE
+MCLOOP  LDR R3, R1, #0
+        STR R3, R0, #0
+        ADD R0, R0, #1
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp MCLOOP
+MCDONE  LDR R3, R6, #0
+        LDR R2, R6, #1
+        LDR R1, R6, #2
+        LDR R0, R6, #3
+        ADD R6, R6, #4
+        RET
+.END
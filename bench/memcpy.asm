@@ -0,0 +1,21 @@
+; memcpy: copies 4096 words from x4000 to x6000 with LDR/STR, 1000 times.
+; Exercises loads, stores and the store-to-code checks.
+.ORIG x3000
+        LD R4, REPS
+RLOOP   LD R1, SRC
+        LD R2, DST
+        LD R3, LEN
+CLOOP   LDR R0, R1, #0
+        STR R0, R2, #0
+        ADD R1, R1, #1
+        ADD R2, R2, #1
+        ADD R3, R3, #-1
+        BRp CLOOP
+        ADD R4, R4, #-1
+        BRp RLOOP
+        HALT
+REPS    .FILL #1000
+SRC     .FILL x4000
+DST     .FILL x6000
+LEN     .FILL #4096
+.END
@@ -0,0 +1,12 @@
+; puts: prints a 55 character line through TRAP x22 (PUTS) 30000 times.
+; Exercises the trap path and console output buffering.
+.ORIG x3000
+        LD R1, REPS
+LOOP    LEA R0, MSG
+        PUTS
+        ADD R1, R1, #-1
+        BRp LOOP
+        HALT
+REPS    .FILL #30000
+MSG     .STRINGZ "The quick brown fox jumps over the lazy dog 0123456789\n"
+.END
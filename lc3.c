@@ -1,5 +1,9 @@
+#define _GNU_SOURCE // REG_RIP in ucontext_t, for the sampling profiler
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
 #include <signal.h>
 // unix only
 #include <stdlib.h>
@@ -7,8 +11,16 @@
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ucontext.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 // TRAP CODES
 enum
@@ -18,25 +30,53 @@ enum
     TRAP_PUTS = 0x22,  // output a word string
     TRAP_IN = 0x23,    // get character from keyboard, echoed onto the terminal
     TRAP_PUTSP = 0x24, // output a byte string
-    TRAP_HALT = 0x25   // halt the program
+    TRAP_HALT = 0x25,  // halt the program
+    TRAP_WAIT = 0x26   // sleep until a key, a timer tick or a host signal
 };
 
 // MEMORY ARRAY
-#define MEMORY_MAX (1 << 16)
-uint16_t memory[MEMORY_MAX];  // 65536 mem locations
+#define MEMORY_MAX (1 << 16) // 65536 mem locations
+
+// set the PC to starting position
+// 0x3000 is the default
+enum { PC_START = 0x3000 }; // lower addresses are left empty to leave space for the trap routine code
 
 // MEMORY MAPPED REGISTERS
 enum
 {
     MR_KBSR = 0xFE00, // keyboard status
-    MR_KBDR = 0xFE02  // keyboard data
+    MR_KBDR = 0xFE02, // keyboard data
+    MR_DSR = 0xFE04,  // display status
+    MR_DDR = 0xFE06,  // display data
+    MR_TSR = 0xFE08,  // timer status, bit 15 once per interval
+    MR_TMI = 0xFE0A,  // timer interval in milliseconds, 0 stops it
+    MR_FBCR = 0xFE10, // framebuffer control, a write presents the frame
+    MR_FB = 0xFE40,   // framebuffer cells, FB_ROWS x FB_COLS
+    MR_PSR = 0xFFFC,  // processor status
+    MR_MCR = 0xFFFE   // machine control, clearing bit 15 stops the clock
+};
+
+// INTERRUPTS
+enum
+{
+    KBSR_READY = 1 << 15,    // a key is latched in KBDR, cleared by reading KBDR
+    KBSR_IE = 1 << 14,       // interrupt when a key is ready
+    PSR_USER = 1 << 15,      // user mode, else supervisor
+    PSR_PRIORITY = 0x0700,   // priority level 0-7
+    PSR_PRIORITY_SHIFT = 8,
+    INT_TABLE = 0x0100,      // handler address per vector
+    EXC_PRIVILEGE = 0x00,    // RTI in user mode
+    EXC_ILLEGAL = 0x01,      // the reserved opcode
+    INT_KEYBOARD = 0x80,
+    PL_KEYBOARD = 4,
+    SSP_START = 0x3000       // the supervisor stack grows down from here
 };
 
 // GENERAL PURPOSE REGISTERS
-// 10 total, each 16 bits
+// 13 total, each 16 bits
 enum
 {
-    
+
     R_R0 = 0,
     R_R1,
     R_R2,
@@ -49,29 +89,32 @@ enum
     R_PC,
     // condition flag, tell us information about the previous calculation
     R_COND,
+    // processor status without N/Z/P, which stay in R_COND: PSR_USER and the priority
+    R_PSR,
+    // R6 of the mode that is not running
+    R_SAVED_SSP,
+    R_SAVED_USP,
     // num registers
     R_COUNT
 };
 
-uint16_t reg[R_COUNT];
-
 // OPCODES
 enum
 {
     OP_BR = 0, // branch
-    OP_ADD,    // add 
+    OP_ADD,    // add
     OP_LD,     // load
     OP_ST,     // store
     OP_JSR,    // jump register
     OP_AND,    // bitwise and
     OP_LDR,    // load register
     OP_STR,    // store register
-    OP_RTI,    // unused
+    OP_RTI,    // return from interrupt
     OP_NOT,    // bitwise not
     OP_LDI,    // load indirect (load a value from a location in memory into a register)
     OP_STI,    // store indirect
     OP_JMP,    // jump
-    OP_RES,    // reserved (unused)
+    OP_RES,    // reserved, raises EXC_ILLEGAL
     OP_LEA,    // load effective address
     OP_TRAP    // execute trap
 };
@@ -84,374 +127,5251 @@ enum
     FL_NEG = 1 << 2, // N (negative)
 };
 
-// INPUT BUFFERING
-struct termios original_tio;
+// Condition codes are evaluated lazily: reg[R_COND] holds the last value
+// that set them and BR works out N/Z/P from it, so the ALU and load handlers
+// only copy a word. cond_flags() gives the N/Z/P form for anything else that
+// needs it. Build with -DLC3_EAGER_FLAGS to keep N/Z/P in reg[R_COND] and
+// compute them on every update instead, for comparison.
+uint16_t flags_of(uint16_t value)
+{
+    return value == 0 ? FL_ZRO : value >> 15 ? FL_NEG : FL_POS;
+}
+
+#ifdef LC3_EAGER_FLAGS
+#define COND_FLAGS(c) (c)
+#define COND_ZERO FL_ZRO
+#else
+#define COND_FLAGS(c) flags_of(c)
+#define COND_ZERO 0
+#endif
+
+// DECODED INSTRUCTION CACHE
+// Every memory word has a parallel decoded form holding the handler index,
+// register numbers and pre-sign-extended operands, so executing an
+// instruction does no field extraction. Entries are filled lazily the first
+// time a word is executed and dropped again by mem_write(). Machines loaded
+// from the same image can share one cache; whichever of them first needs to
+// change a shared cache takes a private copy of it.
+enum
+{
+    OP_ADDI = 16, // ADD with imm5
+    OP_ANDI,      // AND with imm5
+    OP_JSRR,      // JSR through a base register
+    OP_NATIVE,    // JSR to a routine the intrinsics library runs natively
+    OP_DECODE,    // word has not been decoded yet
+    OP_ADD_BR,    // superinstructions: this word and the next as one dispatch
+    OP_ADDI_BR,
+    OP_LDI_BR,
+    OP_CLR_ADDI,  // AND R,R,#0 then ADD R,R,#imm
+    OP_HANDLERS
+};
+
+enum { OP_FUSED = OP_ADD_BR }; // first superinstruction handler
+
+struct decoded
+{
+    uint8_t op;   // handler index: OP_* or one of the decoder-only handlers above;
+                  // a superinstruction keeps the fields of its first word
+    uint8_t r0;   // DR, SR for stores, n/z/p mask for BR
+    uint8_t r1;   // SR1 / BaseR
+    uint8_t r2;   // SR2, library index for OP_NATIVE
+    uint16_t imm; // imm5 / offset6, absolute target for PC-relative forms, trapvect8
+};
+
+struct code_cache
+{
+    _Atomic int refs;   // machines using this cache
+    int prepared;       // reachable code was decoded up front for sharing
+    struct decoded decoded[MEMORY_MAX];
+};
+
+// KEYBOARD INPUT
+enum { INPUT_RING_SIZE = 256 }; // power of two
+
+struct input_ring
+{
+    _Atomic uint32_t head;  // next slot the producer fills
+    _Atomic uint32_t tail;  // next slot the consumer takes
+    _Atomic int eof;
+    uint8_t data[INPUT_RING_SIZE];
+};
+
+// CONSOLE OUTPUT
+enum { OUTPUT_BUFFER_SIZE = 1 << 16 };
+
+// SNAPSHOTS
+// memory is tracked in pages of 256 words for snapshot restore
+enum
+{
+    PAGE_SHIFT = 8,
+    PAGE_SIZE = 1 << PAGE_SHIFT,
+    PAGE_COUNT = MEMORY_MAX >> PAGE_SHIFT
+};
+
+struct snapshot
+{
+    uint16_t reg[R_COUNT];
+    uint16_t memory[MEMORY_MAX];
+};
+
+// COUNTERS
+// Live event counts, kept in a file mapping when --counters=PATH is given so
+// a monitor can read them while the guest runs. Fields are plain 64-bit
+// words: a reader may see a slightly stale value, never a torn one.
+enum
+{
+    COUNTERS_MAGIC = 0x4C433343, // "C3CL" little endian
+    COUNTERS_VERSION = 2,
+    COUNT_DECODES = 16,          // opcodes[] slot for words decoded into the cache
+    TRAP_VECTORS = TRAP_WAIT - TRAP_GETC + 1
+};
+
+struct counters
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t opcodes[17];        // by OP_*, plus COUNT_DECODES
+    uint64_t traps[TRAP_VECTORS]; // by TRAP_* - TRAP_GETC
+    uint64_t bad_traps;          // any other vector
+    uint64_t kbsr_reads;
+    uint64_t kbdr_reads;
+    uint64_t branches_taken;
+    uint64_t branches_not_taken;
+};
+
+// opcodes[] slot per decoded handler
+const uint8_t handler_opcode[OP_HANDLERS] = {
+    OP_BR, OP_ADD, OP_LD, OP_ST, OP_JSR, OP_AND, OP_LDR, OP_STR,
+    OP_RTI, OP_NOT, OP_LDI, OP_STI, OP_JMP, OP_RES, OP_LEA, OP_TRAP,
+    OP_ADD, OP_AND, OP_JSR, OP_JSR, COUNT_DECODES,
+    OP_ADD, OP_ADD, OP_LDI, OP_AND // second word is counted by its handler
+};
+
+// RECORD AND REPLAY
+struct replay_event
+{
+    uint64_t count; // retired instructions when the guest took the key
+    int key;        // -1 for end of input
+};
+
+// DEVICES
+// Memory-mapped devices are found through a table with one entry per page:
+// NULL for plain memory, so an ordinary load or store costs one table check,
+// otherwise a page of per-word device pointers. A device word without a read
+// or write callback acts as memory in that direction.
+struct vm;
+
+struct device
+{
+    const char* name;
+    uint16_t (*read)(struct vm* vm, uint16_t address);
+    void (*write)(struct vm* vm, uint16_t address, uint16_t val);
+};
+
+struct io_page
+{
+    const struct device* device[PAGE_SIZE];
+};
+
+enum
+{
+    FB_COLS = 32,
+    FB_ROWS = 12,
+    FB_CELLS = FB_COLS * FB_ROWS, // ends at 0xFFC0, below MR_MCR
+    FB_FG = 0x0700,               // cell bits: ANSI foreground color 0-7
+    FB_BOLD = 0x0800,
+    FB_COLOR = 0x1000,            // use the attribute bits, else the default look
+    FB_BRIDGE = 4                 // unchanged cells rewritten instead of moving the cursor
+};
+
+// VIRTUAL MACHINE
+// Everything one guest owns. Functions that touch guest state take the
+// machine as their first argument, so any number of them can run side by
+// side in one process.
+struct jit;
+
+struct vm
+{
+    uint16_t reg[R_COUNT]; // first, so the JIT reaches registers with 8-bit offsets
+    uint16_t* memory;      // MEMORY_MAX words
+    int memory_mapped;     // memory is a private mapping of an image cache
+    int images;            // images loaded
+    struct io_page* io[PAGE_COUNT]; // devices by page, NULL for plain memory
+    struct code_cache* code;
+    uint64_t instr_count;  // retired instructions
+
+    // DEVICES
+    int halted;            // MCR clock stopped
+    int interrupts;        // KBSR_IE is set above the current priority: check at control transfers
+    uint16_t timer_ms;     // MR_TMI, 0 when the timer is off
+    double timer_due;      // now_seconds() of the next tick
+    uint16_t* fb_shown;    // framebuffer as last presented, NULL before the first
+
+    // INTRINSICS
+    int intrinsics;        // --intrinsics: 1 runs library routines natively, 2 checks them too
+    unsigned native_failed; // library routines that failed a check, left to the guest
+    uint64_t native_calls;
+    struct vm* native_scratch[2]; // copies for checking, NULL until needed
+
+    // WAIT
+    unsigned wake_seen;    // wake_signals already reported by a WAIT
+    int yield_waits;       // a WAIT that would sleep leaves run() instead (batch)
+    int suspended;         // left run() in a WAIT, continue with wait_resume()
+
+    // SNAPSHOTS
+    const struct snapshot* snapshot; // last snapshot taken or restored
+    uint8_t dirty[PAGE_COUNT];       // page written since then
 
-void disable_input_buffering()
+    // KEYBOARD INPUT
+    struct input_ring input;
+    int input_fd;
+    uint8_t* script;       // keys held in memory, used instead of input_fd when set
+    size_t script_len;
+    size_t script_pos;
+    int input_inline;      // input_fd is a regular file or there is a script: fill the ring from the VM thread
+    int input_threaded;    // a reader thread owns input_fd
+    int input_done;        // the guest has read the end of input
+    pthread_t input_thread;
+    pthread_mutex_t input_lock;
+    pthread_cond_t input_ready; // data or EOF arrived
+    pthread_cond_t input_space; // the consumer freed a slot
+    _Atomic uint64_t input_reads; // read() calls, from whichever thread fills the ring
+
+    // RECORD AND REPLAY
+    FILE* record;                  // --record log, NULL when not recording
+    struct replay_event* replay;   // --replay events, NULL when not replaying
+    size_t replay_len;
+    size_t replay_pos;
+    int replay_diverged;
+    uint64_t instr_pending;        // counted in instr_count but not retired yet (JIT blocks)
+
+    // CONSOLE OUTPUT
+    int out_fd;                // -1 discards output unless it is captured
+    int out_capture;           // collect output in capture[] instead of writing it
+    char* capture;
+    size_t capture_len;
+    size_t capture_cap;
+    uint64_t out_bytes;        // total guest output
+    size_t out_len;
+    size_t out_limit;          // --out-bytes
+    int out_interval_ms;       // --out-ms
+    double out_since;          // when the oldest pending byte was written
+    uint64_t out_flush_points; // flushes the old per-trap code would have done
+    uint64_t out_writes;
+    char out_buf[OUTPUT_BUFFER_SIZE];
+
+    // IDLE DETECTION
+    uint16_t idle_pc;      // PC of the last empty poll
+    uint64_t idle_at;      // instr_count at the last empty poll
+    int idle_spins;
+    uint64_t idle_parks;   // times a KBSR spin loop was parked
+    double idle_seconds;   // wall time spent waiting for input
+
+    // INPUT BUFFERING
+    struct termios original_tio;
+    int tty;               // original_tio was saved and must be restored
+
+    struct jit* jit;       // NULL unless the machine runs under the JIT
+    struct profile* profile; // NULL unless profiling
+    struct sampler* sampler; // NULL unless --sample
+    volatile int waiting;    // blocked in input_wait(), for the sampler
+    struct counters* counters; // NULL unless --counters
+};
+
+// the machine attached to the terminal, for the SIGINT handler
+struct vm* console_vm;
+
+// INPUT BUFFERING
+void disable_input_buffering(struct vm* vm)
 {
-    tcgetattr(STDIN_FILENO, &original_tio);
-    struct termios new_tio = original_tio;
+    if (tcgetattr(vm->input_fd, &vm->original_tio) != 0)
+    {
+        return; // not a terminal
+    }
+    vm->tty = 1;
+    struct termios new_tio = vm->original_tio;
     new_tio.c_lflag &= ~ICANON & ~ECHO; // Disable canonical mode and echoing
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    tcsetattr(vm->input_fd, TCSANOW, &new_tio);
+}
+
+void restore_input_buffering(struct vm* vm)
+{
+    if (vm->tty)
+    {
+        tcsetattr(vm->input_fd, TCSANOW, &vm->original_tio);
+    }
 }
 
-void restore_input_buffering()
+// STATS
+int show_stats = 0;
+
+double now_seconds()
 {
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-uint16_t check_key()
+// Host counters: with --stats, perf_event_open counts what the host CPU did
+// while run() or run_jit() executed. The counters follow only the VM thread
+// and only user space, so the input thread and time blocked in the kernel
+// are left out. Counters the CPU or the kernel does not offer (virtual
+// machines often have no PMU) are reported as unavailable.
+enum
+{
+    HOST_CYCLES,
+    HOST_INSTRUCTIONS,
+    HOST_BRANCH_MISSES,
+    HOST_L1D_MISSES,
+    HOST_COUNTERS
+};
+
+const struct
+{
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} host_events[HOST_COUNTERS] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "L1d-misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+struct host_counters
 {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
+    int fd[HOST_COUNTERS];      // -1 when the event could not be opened
+    uint64_t value[HOST_COUNTERS];
+    int error;                  // errno of the first event that failed
+};
+
+void host_counters_start(struct host_counters* h)
+{
+    h->error = 0;
+    for (int i = 0; i < HOST_COUNTERS; ++i)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = host_events[i].type;
+        attr.config = host_events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        h->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        h->value[i] = 0;
+        if (h->fd[i] < 0 && !h->error)
+        {
+            h->error = errno;
+        }
+    }
+    // enable them back to back so they cover the same stretch of the loop
+    for (int i = 0; i < HOST_COUNTERS; ++i)
+    {
+        if (h->fd[i] >= 0) ioctl(h->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
 
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+void host_counters_stop(struct host_counters* h)
+{
+    for (int i = 0; i < HOST_COUNTERS; ++i)
+    {
+        if (h->fd[i] >= 0) ioctl(h->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (int i = 0; i < HOST_COUNTERS; ++i)
+    {
+        uint64_t v[3]; // value, time enabled, time running
+        if (h->fd[i] < 0)
+        {
+            continue;
+        }
+        if (read(h->fd[i], v, sizeof(v)) != sizeof(v) || v[2] == 0)
+        {
+            close(h->fd[i]);
+            h->fd[i] = -1;
+            continue;
+        }
+        // scale up if the kernel had to multiplex the PMU between events
+        h->value[i] = v[2] < v[1] ? (uint64_t)((double)v[0] * v[1] / v[2]) : v[0];
+        close(h->fd[i]);
+    }
 }
 
-void handle_interrupt(int signal)
+// CONSOLE OUTPUT
+// Guest output collects in out_buf and goes to out_fd in one write() when the
+// guest blocks for input, halts, or the pending output passes out_limit bytes
+// or has been waiting out_interval_ms. The old code flushed stdout after
+// every output trap; out_flush_points counts those so --stats can report the
+// write() calls saved.
+void out_flush(struct vm* vm)
 {
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
+    vm->out_bytes += vm->out_len;
+    if (vm->out_capture && vm->out_len)
+    {
+        if (vm->capture_len + vm->out_len > vm->capture_cap)
+        {
+            vm->capture_cap = (vm->capture_len + vm->out_len) * 2;
+            vm->capture = realloc(vm->capture, vm->capture_cap);
+        }
+        memcpy(vm->capture + vm->capture_len, vm->out_buf, vm->out_len);
+        vm->capture_len += vm->out_len;
+    }
+    size_t done = vm->out_capture || vm->out_fd < 0 ? vm->out_len : 0;
+    while (done < vm->out_len)
+    {
+        ssize_t n = write(vm->out_fd, vm->out_buf + done, vm->out_len - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        ++vm->out_writes;
+        if (n <= 0)
+        {
+            break; // nowhere to put it, drop the rest
+        }
+        done += n;
+    }
+    vm->out_len = 0;
 }
 
-// Sign extension corrects this problem by filling in 0’s for positive numbers and 1’s for negative numbers
-// original values are preserved
-uint16_t sign_extend(uint16_t x, int bit_count)
+void out_putc(struct vm* vm, char c)
 {
-    if ((x >> (bit_count - 1)) & 1) { // if negative number
-        x |= (0xFFFF << bit_count); // fill with 1's
+    if (vm->out_len == OUTPUT_BUFFER_SIZE)
+    {
+        out_flush(vm);
     }
-    return x;
+    if (vm->out_len == 0)
+    {
+        vm->out_since = now_seconds();
+    }
+    vm->out_buf[vm->out_len++] = c;
 }
 
-void update_flags(uint16_t r)
+void out_puts(struct vm* vm, const char* s)
 {
-    if (reg[r] == 0)
+    while (*s)
     {
-        reg[R_COND] = FL_ZRO;
+        out_putc(vm, *s++);
     }
-    else if (reg[r] >> 15) // 1 in the left-most bit indicates negative
+}
+
+// end of an output trap: the point where stdout used to be flushed
+void out_trap_done(struct vm* vm)
+{
+    ++vm->out_flush_points;
+    if (vm->out_len >= vm->out_limit
+        || (vm->out_len && (now_seconds() - vm->out_since) * 1000 >= vm->out_interval_ms))
+    {
+        out_flush(vm);
+    }
+}
+
+// KEYBOARD INPUT
+// Guest input comes out of a single-producer/single-consumer ring. For a TTY
+// or pipe a reader thread owns the input fd and blocks in read(), so polling
+// MR_KBSR is just a head/tail compare with no syscall. A regular file never
+// blocks, so it is read in chunks on demand by the VM thread itself.
+
+// read whatever fits into the free part of the ring, returns 0 at EOF
+int input_fill(struct vm* vm)
+{
+    struct input_ring* input = &vm->input;
+    uint32_t head = atomic_load_explicit(&input->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&input->tail, memory_order_acquire);
+    uint32_t slot = head & (INPUT_RING_SIZE - 1);
+    uint32_t room = INPUT_RING_SIZE - (head - tail);
+    if (room > INPUT_RING_SIZE - slot)
+    {
+        room = INPUT_RING_SIZE - slot; // stop at the wrap, the next call continues
+    }
+
+    ssize_t n;
+    if (vm->script)
     {
-        reg[R_COND] = FL_NEG;
+        n = vm->script_len - vm->script_pos;
+        n = n < room ? n : room;
+        memcpy(input->data + slot, vm->script + vm->script_pos, n);
+        vm->script_pos += n;
     }
     else
     {
-        reg[R_COND] = FL_POS;
+        do {
+            n = read(vm->input_fd, input->data + slot, room);
+            atomic_fetch_add_explicit(&vm->input_reads, 1, memory_order_relaxed);
+        } while (n < 0 && errno == EINTR);
     }
+
+    if (n <= 0)
+    {
+        atomic_store_explicit(&input->eof, 1, memory_order_release);
+        return 0;
+    }
+    atomic_store_explicit(&input->head, head + n, memory_order_release);
+    return 1;
 }
 
-uint16_t swap16(uint16_t x)
+// pthread_cleanup_push() handler
+void unlock_mutex(void* mutex)
 {
-    return (x << 8) | (x >> 8);
+    pthread_mutex_unlock(mutex);
 }
 
-void read_image_file(FILE* file)
+void* input_reader(void* arg)
 {
-    // the origin tells us where in memory to place the image
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
+    struct vm* vm = arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&vm->input_lock);
+        pthread_cleanup_push(unlock_mutex, &vm->input_lock); // vm_destroy() cancels us here or in read()
+        while (atomic_load(&vm->input.head) - atomic_load(&vm->input.tail) == INPUT_RING_SIZE)
+        {
+            pthread_cond_wait(&vm->input_space, &vm->input_lock);
+        }
+        pthread_cleanup_pop(1);
 
-    // we know the maximum file size so we only need one fread
-    uint16_t max_read = MEMORY_MAX - origin;
-    uint16_t* p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+        int more = input_fill(vm);
+
+        pthread_mutex_lock(&vm->input_lock);
+        pthread_cond_signal(&vm->input_ready);
+        pthread_mutex_unlock(&vm->input_lock);
+        if (!more)
+        {
+            return NULL;
+        }
+    }
+}
 
-    // swap to little endian
-    while (read-- > 0)
+void start_input(struct vm* vm)
+{
+    struct stat st;
+    if (vm->replay || vm->script || (fstat(vm->input_fd, &st) == 0 && S_ISREG(st.st_mode)))
+    {
+        vm->input_inline = 1;
+        return;
+    }
+    if (pthread_create(&vm->input_thread, NULL, input_reader, vm) == 0)
     {
-        *p = swap16(*p);
-        ++p;
+        vm->input_threaded = 1;
     }
 }
 
-int read_image(const char* image_path)
+// feed the guest keys from memory, replaces any earlier script
+void vm_set_script(struct vm* vm, const void* keys, size_t len)
 {
-    FILE* file = fopen(image_path, "rb");
-    if (!file) { return 0; };
-    read_image_file(file);
+    free(vm->script);
+    vm->script = malloc(len ? len : 1);
+    memcpy(vm->script, keys, len);
+    vm->script_len = len;
+    vm->script_pos = 0;
+}
+
+// the whole file at path as the script, returns 0 if it cannot be read
+int vm_load_script(struct vm* vm, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) { return 0; }
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    free(vm->script);
+    vm->script = malloc(len > 0 ? len : 1);
+    vm->script_len = fread(vm->script, 1, len > 0 ? len : 0, file);
+    vm->script_pos = 0;
     fclose(file);
     return 1;
 }
 
-void mem_write(uint16_t address, uint16_t val)
+// RECORD AND REPLAY
+// --record=FILE logs every key the guest takes, from a KBSR poll or a GETC/IN
+// trap, with the number of instructions retired at that point. --replay=FILE
+// hands the keys back at exactly those counts: KBSR reports ready once the
+// count is reached and a trap takes the next key at once, so the guest sees
+// the same input at the same point of its execution and nothing ever waits.
+// The log is text, a header line and then "count key" per event.
+
+// instructions retired so far; the JIT counts a block ahead when it starts it
+uint64_t vm_instructions(struct vm* vm)
+{
+    return vm->instr_count - vm->instr_pending;
+}
+
+int record_open(struct vm* vm, const char* path)
 {
-    memory[address] = val;
+    vm->record = fopen(path, "w");
+    if (!vm->record) { return 0; }
+    fprintf(vm->record, "lc3-replay 1\n");
+    return 1;
 }
 
+void record_key(struct vm* vm, int c)
+{
+    fprintf(vm->record, "%llu %d\n", (unsigned long long)vm_instructions(vm), c);
+}
 
-uint16_t mem_read(uint16_t address)
+int replay_load(struct vm* vm, const char* path)
 {
-    if (address == MR_KBSR)
+    FILE* file = fopen(path, "r");
+    if (!file || fscanf(file, "lc3-replay %*d") != 0) { return 0; }
+    size_t cap = 256;
+    vm->replay = malloc(cap * sizeof(struct replay_event));
+    unsigned long long count;
+    int key;
+    while (fscanf(file, "%llu %d", &count, &key) == 2)
     {
-        if (check_key())
-        {
-            memory[MR_KBSR] = (1 << 15); // set the "keyboard ready" bit
-            memory[MR_KBDR] = getchar(); // read the character
-        }
-        else
+        if (vm->replay_len == cap)
         {
-            memory[MR_KBSR] = 0; // clear the "keyboard ready" bit
+            cap *= 2;
+            vm->replay = realloc(vm->replay, cap * sizeof(struct replay_event));
         }
+        vm->replay[vm->replay_len++] = (struct replay_event){ count, key };
     }
-    return memory[address];
- }
+    fclose(file);
+    return 1;
+}
 
-int main(int argc, const char* argv[])
+// the next event is due; running out of events reads as end of input
+int replay_ready(struct vm* vm)
 {
-    // LOAD ARGS
-    if (argc < 2) {
-        // show usage string
-        printf("Not enough arguments! ex: ./lc3-vm 2048.obj\n");
-        exit(2);
+    return vm->replay_pos == vm->replay_len
+        || vm_instructions(vm) >= vm->replay[vm->replay_pos].count;
+}
+
+int replay_getc(struct vm* vm)
+{
+    if (vm->replay_pos == vm->replay_len)
+    {
+        vm->input_done = 1;
+        return -1;
+    }
+    const struct replay_event* e = &vm->replay[vm->replay_pos++];
+    if (e->count != vm_instructions(vm) && !vm->replay_diverged)
+    {
+        vm->replay_diverged = 1;
+        fprintf(stderr, "replay diverged: key %d recorded at instruction %llu, taken at %llu\n",
+                e->key, (unsigned long long)e->count, (unsigned long long)vm_instructions(vm));
     }
+    return e->key;
+}
 
-    for (int j = 1; j < argc; ++j) {
-        if (!read_image(argv[j])) {
-            printf("failed to load image: %s\n", argv[j]);
-            exit(1);
+// a key (or EOF, which reads as 0xFFFF like getchar() did) is waiting
+int input_available(struct vm* vm)
+{
+    struct input_ring* input = &vm->input;
+    if (vm->replay)
+    {
+        return replay_ready(vm);
+    }
+    if (atomic_load_explicit(&input->head, memory_order_acquire) != atomic_load_explicit(&input->tail, memory_order_relaxed)
+        || atomic_load_explicit(&input->eof, memory_order_acquire))
+    {
+        return 1;
+    }
+    if (vm->input_inline)
+    {
+        input_fill(vm);
+        return 1; // either data or EOF now
+    }
+    return 0;
+}
+
+// sleep until a key or EOF arrives, or timeout_ms passes (never when negative)
+void input_wait(struct vm* vm, int timeout_ms)
+{
+    out_flush(vm); // the guest is about to block, show it everything it wrote
+    double start = now_seconds();
+    vm->waiting = 1;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (timeout_ms >= 0)
+    {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
         }
     }
 
-    // SETUP
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
+    pthread_mutex_lock(&vm->input_lock);
+    while (atomic_load(&vm->input.head) == atomic_load(&vm->input.tail) && !atomic_load(&vm->input.eof))
+    {
+        if (timeout_ms < 0)
+        {
+            pthread_cond_wait(&vm->input_ready, &vm->input_lock);
+        }
+        else if (pthread_cond_timedwait(&vm->input_ready, &vm->input_lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&vm->input_lock);
 
-    // since exactly one condition flag should be set at any given time, set the Z flag
-    reg[R_COND] = FL_ZRO;
+    vm->waiting = 0;
+    vm->idle_seconds += now_seconds() - start;
+}
 
-    // set the PC to starting position
-    // 0x3000 is the default
-    enum { PC_START = 0x3000 }; // lower addresses are left empty to leave space for the trap routine code
-    reg[R_PC] = PC_START;
+// blocks until a key arrives, -1 at end of input
+int input_getc(struct vm* vm)
+{
+    struct input_ring* input = &vm->input;
+    if (vm->replay)
+    {
+        return replay_getc(vm);
+    }
+    if (!input_available(vm))
+    {
+        input_wait(vm, -1);
+    }
 
-    // LOOP
-    int running = 1;
-    while (running) {
-        
-        // FETCH INSTR AND GET OP
-        uint16_t instr = mem_read(reg[R_PC]++);
-        uint16_t op = instr >> 12;
+    uint32_t head = atomic_load_explicit(&input->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&input->tail, memory_order_relaxed);
+    if (head == tail)
+    {
+        vm->input_done = 1;
+        return -1;
+    }
+    int c = input->data[tail & (INPUT_RING_SIZE - 1)];
+    atomic_store_explicit(&input->tail, tail + 1, memory_order_release);
 
-        switch (op)
-        {
-            case OP_ADD:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7; // destination register (DR)   
-                    uint16_t r1 = (instr >> 6) & 0x7; // first operand (SR1)
+    if (head - tail == INPUT_RING_SIZE && vm->input_threaded)
+    {
+        // the reader may be waiting for this slot
+        pthread_mutex_lock(&vm->input_lock);
+        pthread_cond_signal(&vm->input_space);
+        pthread_mutex_unlock(&vm->input_lock);
+    }
+    if (vm->record)
+    {
+        record_key(vm, c);
+    }
+    return c;
+}
 
-                    // immediate mode flag
-                    uint16_t imm_flag = (instr >> 5) & 0x1;
-                    if (imm_flag) {
-                        uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-                        reg[r0] = reg[r1] + imm5;
-                    }
-                    else {
-                        uint16_t r2 = instr & 0x7;
-                        reg[r0] = reg[r1] + reg[r2];
-                    }
+// COUNTERS
+// counters in a fresh shared file mapping at path, or private memory without one
+struct counters* counters_create(const char* path)
+{
+    struct counters* c;
+    if (path)
+    {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(struct counters)) != 0)
+        {
+            printf("failed to create counters file: %s\n", path);
+            exit(1);
+        }
+        c = mmap(NULL, sizeof(struct counters), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (c == MAP_FAILED)
+        {
+            printf("failed to map counters file: %s\n", path);
+            exit(1);
+        }
+    }
+    else
+    {
+        c = calloc(1, sizeof(struct counters));
+    }
+    c->version = COUNTERS_VERSION;
+    c->magic = COUNTERS_MAGIC;
+    return c;
+}
 
-                    update_flags(r0);
-                    break;
-                }
-            case OP_AND:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7; // destination register (DR)
-                    uint16_t r1 = (instr >> 6) & 0x7; // first operand (SR1)
+// Counter reports are formatted by hand: snprintf() is not async-signal-safe
+// and the SIGUSR1 handler formats them too. Like snprintf(), the put_*
+// helpers count what does not fit into buf without writing it.
+void put_text(char* buf, size_t size, size_t* n, const char* text, int width)
+{
+    int i = 0;
+    for (; text[i]; ++i, ++*n)
+    {
+        if (*n < size)
+        {
+            buf[*n] = text[i];
+        }
+    }
+    for (; i < width; ++i, ++*n)
+    {
+        if (*n < size)
+        {
+            buf[*n] = ' ';
+        }
+    }
+}
 
-                    uint16_t imm_flag = (instr >> 5) & 0x1;
-                    if (imm_flag) {
-                        uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-                        reg[r0] = reg[r1] & imm5;
-                    }
-                    else {
-                        uint16_t r2 = instr & 0x7;
-                        reg[r0] = reg[r1] & reg[r2];
+// "prefix name value\n", name padded to width
+void put_counter(char* buf, size_t size, size_t* n, const char* prefix, const char* name,
+                 int width, uint64_t value)
+{
+    char digits[24];
+    int i = sizeof(digits);
+    digits[--i] = '\0';
+    digits[--i] = '\n';
+    do
+    {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    put_text(buf, size, n, prefix, 0);
+    put_text(buf, size, n, name, width);
+    put_text(buf, size, n, " ", 0);
+    put_text(buf, size, n, digits + i, 0);
+}
+
+int format_counters(const struct counters* c, char* buf, size_t size)
+{
+    static const char* op_names[17] = {
+        "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+        "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP", "decodes"
+    };
+    static const char* trap_names[TRAP_VECTORS] = { "GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT", "WAIT" };
+    size_t n = 0;
+    for (int i = 0; i < 17; ++i)
+    {
+        put_counter(buf, size, &n, "op ", op_names[i], 8, c->opcodes[i]);
+    }
+    for (int i = 0; i < TRAP_VECTORS; ++i)
+    {
+        put_counter(buf, size, &n, "trap ", trap_names[i], 6, c->traps[i]);
+    }
+    put_counter(buf, size, &n, "trap ", "other", 6, c->bad_traps);
+    put_counter(buf, size, &n, "read ", "KBSR", 6, c->kbsr_reads);
+    put_counter(buf, size, &n, "read ", "KBDR", 6, c->kbdr_reads);
+    put_counter(buf, size, &n, "branch ", "taken", 9, c->branches_taken);
+    put_counter(buf, size, &n, "branch ", "not taken", 9, c->branches_not_taken);
+    return n;
+}
+
+void write_counters(int fd, const struct counters* c)
+{
+    char buf[2048];
+    int n = format_counters(c, buf, sizeof(buf));
+    write(fd, buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+}
+
+void handle_usr1(int signal)
+{
+    if (console_vm && console_vm->counters)
+    {
+        write_counters(STDERR_FILENO, console_vm->counters);
+    }
+}
+
+// --read-counters=PATH: print the counters of a running VM
+int read_counters(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    struct counters* c = fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct counters)
+        ? MAP_FAILED // a shorter mapping would fault past the end of the file
+        : mmap(NULL, sizeof(struct counters), PROT_READ, MAP_SHARED, fd, 0);
+    if (fd >= 0)
+    {
+        close(fd); // the mapping stays valid
+    }
+    if (c == MAP_FAILED || c->magic != COUNTERS_MAGIC || c->version != COUNTERS_VERSION)
+    {
+        printf("not a counters file: %s\n", path);
+        if (c != MAP_FAILED)
+        {
+            munmap(c, sizeof(struct counters));
+        }
+        return 1;
+    }
+    write_counters(STDOUT_FILENO, c);
+    munmap(c, sizeof(struct counters));
+    return 0;
+}
+
+// SIGUSR2 wakes guests sleeping in TRAP_WAIT
+_Atomic unsigned wake_signals;
+
+void handle_usr2(int signal)
+{
+    atomic_fetch_add(&wake_signals, 1);
+}
+
+void profile_save(struct vm* vm);
+void sample_save(struct vm* vm);
+
+void handle_interrupt(int signal)
+{
+    restore_input_buffering(console_vm);
+    profile_save(console_vm);
+    sample_save(console_vm);
+    handle_usr1(signal);
+    out_putc(console_vm, '\n');
+    out_flush(console_vm);
+    exit(-2);
+}
+
+// Sign extension corrects this problem by filling in 0’s for positive numbers and 1’s for negative numbers
+// original values are preserved
+uint16_t sign_extend(uint16_t x, int bit_count)
+{
+    if ((x >> (bit_count - 1)) & 1) { // if negative number
+        x |= (0xFFFF << bit_count); // fill with 1's
+    }
+    return x;
+}
+
+#ifndef LC3_EAGER_FLAGS
+void update_flags(struct vm* vm, uint16_t r)
+{
+    vm->reg[R_COND] = vm->reg[r];
+}
+#else
+void update_flags(struct vm* vm, uint16_t r)
+{
+    if (vm->reg[r] == 0)
+    {
+        vm->reg[R_COND] = FL_ZRO;
+    }
+    else if (vm->reg[r] >> 15) // 1 in the left-most bit indicates negative
+    {
+        vm->reg[R_COND] = FL_NEG;
+    }
+    else
+    {
+        vm->reg[R_COND] = FL_POS;
+    }
+}
+#endif
+
+// N, Z or P for the current condition codes
+uint16_t cond_flags(struct vm* vm)
+{
+    return COND_FLAGS(vm->reg[R_COND]);
+}
+
+// the inverse, for a PSR written or restored by RTI
+void set_cond_flags(struct vm* vm, uint16_t flags)
+{
+#ifdef LC3_EAGER_FLAGS
+    vm->reg[R_COND] = flags & FL_NEG ? FL_NEG : flags & FL_ZRO ? FL_ZRO : FL_POS;
+#else
+    vm->reg[R_COND] = flags & FL_NEG ? 0x8000 : flags & FL_ZRO ? 0 : 1;
+#endif
+}
+
+// IMAGE CACHE
+// Loading an image keeps a sidecar next to it, IMAGE.le: the whole memory of
+// a machine that loaded only that image, in native byte order, followed by a
+// trailer naming the object file it was made from by size and hash. When the
+// trailer matches, the first image of a machine is not read or swapped at
+// all: its memory is the sidecar mapped copy-on-write, and the pages are
+// shared with every other process started from the same image until a guest
+// writes to them.
+enum
+{
+    IMAGE_CACHE_MAGIC = 0x454C3343, // "C3LE" little endian
+    IMAGE_CACHE_VERSION = 1,
+    IMAGE_CACHE_BYTES = MEMORY_MAX * sizeof(uint16_t)
+};
+
+struct image_cache_trailer
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size; // of the object file
+    uint64_t hash; // FNV-1a of the object file
+};
+
+uint64_t hash_bytes(const uint8_t* p, size_t n)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    while (n-- > 0)
+    {
+        h = (h ^ *p++) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+// place the big-endian object file obj into memory
+void load_image_words(uint16_t* memory, const uint8_t* obj, size_t size)
+{
+    if (size < 2)
+    {
+        return;
+    }
+    // the origin tells us where in memory to place the image
+    uint16_t origin = obj[0] << 8 | obj[1];
+    size_t words = (size - 2) / 2;
+    if (words > (size_t)MEMORY_MAX - origin)
+    {
+        words = MEMORY_MAX - origin;
+    }
+    for (size_t i = 0; i < words; ++i)
+    {
+        memory[origin + i] = obj[2 + 2 * i] << 8 | obj[3 + 2 * i];
+    }
+}
+
+// the memory in the cache at path, NULL unless it was made from this object
+uint16_t* image_cache_map(const char* path, uint64_t size, uint64_t hash)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    struct image_cache_trailer t;
+    void* memory = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == IMAGE_CACHE_BYTES + sizeof(t)
+        && pread(fd, &t, sizeof(t), IMAGE_CACHE_BYTES) == sizeof(t)
+        && t.magic == IMAGE_CACHE_MAGIC && t.version == IMAGE_CACHE_VERSION
+        && t.size == size && t.hash == hash)
+    {
+        memory = mmap(NULL, IMAGE_CACHE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    return memory == MAP_FAILED ? NULL : memory;
+}
+
+// Best effort: written under a temporary name and renamed into place, so a
+// concurrent reader sees either the old cache or the complete new one.
+void image_cache_write(const char* path, const uint16_t* memory, uint64_t size, uint64_t hash)
+{
+    size_t len = strlen(path) + 32;
+    char* tmp = malloc(len);
+    snprintf(tmp, len, "%s.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0)
+    {
+        struct image_cache_trailer t = { IMAGE_CACHE_MAGIC, IMAGE_CACHE_VERSION, size, hash };
+        int ok = write(fd, memory, IMAGE_CACHE_BYTES) == IMAGE_CACHE_BYTES
+            && write(fd, &t, sizeof(t)) == sizeof(t);
+        ok &= close(fd) == 0;
+        if (!ok || rename(tmp, path) != 0)
+        {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+}
+
+int read_image(struct vm* vm, const char* image_path)
+{
+    int fd = open(image_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) { return 0; };
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    const uint8_t* obj = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (obj == MAP_FAILED)
+    {
+        return 0;
+    }
+    uint64_t hash = hash_bytes(obj, size);
+
+    // only the first image can take over the whole memory
+    size_t len = strlen(image_path) + 4;
+    char* cache_path = malloc(len);
+    snprintf(cache_path, len, "%s.le", image_path);
+    uint16_t* mapped = vm->images ? NULL : image_cache_map(cache_path, size, hash);
+    if (mapped)
+    {
+        free(vm->memory);
+        vm->memory = mapped;
+        vm->memory_mapped = 1;
+    }
+    else
+    {
+        load_image_words(vm->memory, obj, size);
+        if (!vm->images)
+        {
+            image_cache_write(cache_path, vm->memory, size, hash);
+        }
+    }
+    free(cache_path);
+    if (obj)
+    {
+        munmap((void*)obj, size);
+    }
+    ++vm->images;
+    return 1;
+}
+
+// DECODED INSTRUCTION CACHE
+struct code_cache* code_cache_create()
+{
+    struct code_cache* code = malloc(sizeof(struct code_cache));
+    atomic_init(&code->refs, 1);
+    code->prepared = 0;
+    for (int i = 0; i < MEMORY_MAX; ++i)
+    {
+        code->decoded[i].op = OP_DECODE;
+    }
+    return code;
+}
+
+void code_cache_release(struct code_cache* code)
+{
+    if (atomic_fetch_sub(&code->refs, 1) == 1)
+    {
+        free(code);
+    }
+}
+
+// the decoded array of vm, unshared first if other machines still use it
+struct decoded* code_writable(struct vm* vm)
+{
+    struct code_cache* code = vm->code;
+    if (atomic_load(&code->refs) > 1)
+    {
+        struct code_cache* copy = malloc(sizeof(struct code_cache));
+        memcpy(copy->decoded, code->decoded, sizeof(copy->decoded));
+        atomic_init(&copy->refs, 1);
+        copy->prepared = 0;
+        vm->code = copy;
+        code_cache_release(code);
+    }
+    return vm->code->decoded;
+}
+
+void decode_word(struct decoded* d, uint16_t instr, uint16_t pc)
+{
+    uint16_t next = pc + 1; // PC-relative offsets are taken from the incremented PC
+
+    d->op = instr >> 12;
+    d->r0 = (instr >> 9) & 0x7;
+    d->r1 = (instr >> 6) & 0x7;
+    d->r2 = instr & 0x7;
+    d->imm = 0;
+
+    switch (d->op)
+    {
+        case OP_ADD:
+        case OP_AND:
+            if ((instr >> 5) & 0x1) {
+                d->op = d->op == OP_ADD ? OP_ADDI : OP_ANDI;
+                d->imm = sign_extend(instr & 0x1F, 5);
+            }
+            break;
+        case OP_BR:
+        case OP_LD:
+        case OP_LDI:
+        case OP_LEA:
+        case OP_ST:
+        case OP_STI:
+            d->imm = next + sign_extend(instr & 0x1FF, 9);
+            break;
+        case OP_LDR:
+        case OP_STR:
+            d->imm = sign_extend(instr & 0x3F, 6);
+            break;
+        case OP_JSR:
+            if ((instr >> 11) & 1) {
+                d->imm = next + sign_extend(instr & 0x7FF, 11);
+            }
+            else {
+                d->op = OP_JSRR;
+            }
+            break;
+        case OP_TRAP:
+            d->imm = instr & 0xFF;
+            break;
+    }
+}
+
+// SUPERINSTRUCTIONS
+// The common two-word idioms: an ALU or LDI result tested by the BR right
+// after it (countdown and KBSR polling loops), and a register cleared then
+// loaded with a small constant. The fused handler lives in the entry of the
+// first word only; the second word keeps its own plain entry, so a jump into
+// the middle of a pair runs exactly one instruction as before.
+int fused_op(const struct decoded* a, const struct decoded* b)
+{
+    if (b->op == OP_BR)
+    {
+        switch (a->op)
+        {
+            case OP_ADD: return OP_ADD_BR;
+            case OP_ADDI: return OP_ADDI_BR;
+            case OP_LDI: return OP_LDI_BR;
+        }
+    }
+    // b may itself head an ADDI+BR pair; its fields are still the ADDI's
+    if (a->op == OP_ANDI && a->imm == 0 && (b->op == OP_ADDI || b->op == OP_ADDI_BR)
+        && b->r0 == a->r0 && b->r1 == a->r0)
+    {
+        return OP_CLR_ADDI;
+    }
+    return 0;
+}
+
+// fuse pc with pc + 1 once both words are decoded
+void fuse(struct vm* vm, uint16_t pc)
+{
+    const struct decoded* decoded = vm->code->decoded;
+    if (pc == MEMORY_MAX - 1 || decoded[pc].op >= OP_DECODE)
+    {
+        return;
+    }
+    int op = fused_op(&decoded[pc], &decoded[pc + 1]);
+    if (op)
+    {
+        code_writable(vm)[pc].op = op;
+    }
+}
+
+int native_find(struct vm* vm, uint16_t address);
+
+void decode(struct vm* vm, uint16_t pc)
+{
+    struct decoded* d = &code_writable(vm)[pc];
+    decode_word(d, vm->memory[pc], pc);
+    if (d->op == OP_JSR && vm->intrinsics)
+    {
+        int index = native_find(vm, d->imm);
+        if (index >= 0)
+        {
+            d->op = OP_NATIVE;
+            d->r2 = index;
+        }
+    }
+    fuse(vm, pc);
+    fuse(vm, pc - 1);
+}
+
+// Drop the decoded form of address, and of a superinstruction that covers it
+// from the word before.
+void invalidate_word(struct vm* vm, uint16_t address)
+{
+    uint16_t prev = address - 1;
+    int fused = vm->code->decoded[prev].op >= OP_FUSED; // never true for 0xFFFF
+    if (vm->code->decoded[address].op != OP_DECODE || fused)
+    {
+        struct decoded* decoded = code_writable(vm);
+        decoded[address].op = OP_DECODE;
+        if (fused)
+        {
+            decoded[prev].op = OP_DECODE;
+        }
+    }
+}
+
+// Decode everything reachable from the PC ahead of time, following branches,
+// calls and fall-through, so that machines sharing the cache never need to
+// decode (and therefore copy it) while they run.
+void code_cache_prepare(struct vm* vm)
+{
+    uint16_t* work = malloc(MEMORY_MAX * sizeof(uint16_t)); // at most one push per decoded word
+    struct decoded* decoded = code_writable(vm);
+    int n = 0;
+    work[n++] = vm->reg[R_PC];
+
+    while (n > 0)
+    {
+        uint16_t pc = work[--n];
+        while (pc < MR_KBSR && decoded[pc].op == OP_DECODE)
+        {
+            decode(vm, pc);
+            const struct decoded* d = &decoded[pc];
+            uint16_t next = pc + 1;
+            if ((d->op == OP_BR && d->r0) || d->op == OP_JSR || d->op == OP_NATIVE)
+            {
+                work[n++] = d->imm;
+            }
+            if ((d->op == OP_BR && d->r0 == (FL_NEG | FL_ZRO | FL_POS))
+                || d->op == OP_JMP || d->op == OP_RTI || d->op == OP_RES
+                || (d->op == OP_TRAP && d->imm == TRAP_HALT))
+            {
+                break; // no fall-through
+            }
+            pc = next;
+        }
+    }
+    free(work);
+    vm->code->prepared = 1;
+}
+
+// VIRTUAL MACHINE
+void vm_map_devices(struct vm* vm);
+void interrupt_update(struct vm* vm);
+
+struct vm* vm_create()
+{
+    struct vm* vm = calloc(1, sizeof(struct vm));
+    vm->memory = calloc(MEMORY_MAX, sizeof(uint16_t));
+    vm->code = code_cache_create();
+
+    // since exactly one condition flag should be set at any given time, set the Z flag
+    vm->reg[R_COND] = COND_ZERO;
+    vm->reg[R_PC] = PC_START;
+    vm->reg[R_PSR] = PSR_USER; // priority 0
+    vm->reg[R_SAVED_SSP] = SSP_START;
+
+    vm->input_fd = STDIN_FILENO;
+    pthread_mutex_init(&vm->input_lock, NULL);
+    pthread_cond_init(&vm->input_ready, NULL);
+    pthread_cond_init(&vm->input_space, NULL);
+
+    vm->out_fd = STDOUT_FILENO;
+    vm->out_limit = 4096;
+    vm->out_interval_ms = 50;
+    vm_map_devices(vm);
+    return vm;
+}
+
+// Run vm on the decoded instructions of from, which must hold the same image.
+// Both machines must be stopped.
+void vm_share_code(struct vm* vm, struct vm* from)
+{
+    if (!from->code->prepared)
+    {
+        code_cache_prepare(from);
+    }
+    atomic_fetch_add(&from->code->refs, 1);
+    code_cache_release(vm->code);
+    vm->code = from->code;
+}
+
+void jit_destroy(struct jit* jit);
+void profile_destroy(struct profile* prof);
+int jit_compiled(struct jit* jit, uint16_t address);
+void jit_flush(struct jit* jit);
+
+void stop_input(struct vm* vm)
+{
+    if (vm->input_threaded)
+    {
+        pthread_cancel(vm->input_thread);
+        pthread_join(vm->input_thread, NULL);
+        vm->input_threaded = 0;
+    }
+}
+
+void vm_destroy(struct vm* vm)
+{
+    stop_input(vm);
+    if (vm->jit)
+    {
+        jit_destroy(vm->jit);
+    }
+    if (vm->profile)
+    {
+        profile_destroy(vm->profile);
+    }
+    pthread_mutex_destroy(&vm->input_lock);
+    pthread_cond_destroy(&vm->input_ready);
+    pthread_cond_destroy(&vm->input_space);
+    code_cache_release(vm->code);
+    for (int page = 0; page < PAGE_COUNT; ++page)
+    {
+        free(vm->io[page]);
+    }
+    free(vm->fb_shown);
+    free(vm->script);
+    free(vm->capture);
+    for (int i = 0; i < 2; ++i)
+    {
+        if (vm->native_scratch[i])
+        {
+            vm_destroy(vm->native_scratch[i]);
+        }
+    }
+    if (vm->memory_mapped)
+    {
+        munmap(vm->memory, IMAGE_CACHE_BYTES);
+    }
+    else
+    {
+        free(vm->memory);
+    }
+    free(vm);
+}
+
+// the device mapped at address, NULL for memory
+const struct device* device_at(const struct vm* vm, uint16_t address)
+{
+    const struct io_page* io = vm->io[address >> PAGE_SHIFT];
+    return io ? io->device[address & (PAGE_SIZE - 1)] : NULL;
+}
+
+void mem_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    vm->dirty[address >> PAGE_SHIFT] = 1;
+    if (vm->io[address >> PAGE_SHIFT])
+    {
+        const struct device* dev = device_at(vm, address);
+        if (dev && dev->write)
+        {
+            dev->write(vm, address, val);
+            return;
+        }
+    }
+    vm->memory[address] = val;
+    invalidate_word(vm, address); // in case the store hit code
+}
+
+// SNAPSHOTS
+// A snapshot holds the registers and a full copy of memory. From then on
+// mem_write() marks the pages the guest touches, so restoring the snapshot
+// into the same machine only copies those pages back. Restoring into another
+// machine, or after a different snapshot, copies everything once.
+struct snapshot* vm_snapshot(struct vm* vm)
+{
+    struct snapshot* snap = malloc(sizeof(struct snapshot));
+    memcpy(snap->reg, vm->reg, sizeof(snap->reg));
+    memcpy(snap->memory, vm->memory, sizeof(snap->memory));
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    vm->snapshot = snap;
+    return snap;
+}
+
+void vm_restore(struct vm* vm, const struct snapshot* snap)
+{
+    int all = vm->snapshot != snap;
+    int flush = 0;
+    for (int page = 0; page < PAGE_COUNT; ++page)
+    {
+        if (!all && !vm->dirty[page])
+        {
+            continue;
+        }
+        uint16_t first = page << PAGE_SHIFT;
+        for (int i = 0; i < (1 << PAGE_SHIFT); ++i)
+        {
+            uint16_t a = first + i;
+            if (vm->memory[a] == snap->memory[a])
+            {
+                continue;
+            }
+            invalidate_word(vm, a);
+            flush |= vm->jit && jit_compiled(vm->jit, a);
+        }
+        memcpy(vm->memory + first, snap->memory + first, sizeof(uint16_t) << PAGE_SHIFT);
+    }
+    if (flush)
+    {
+        jit_flush(vm->jit);
+    }
+    memcpy(vm->reg, snap->reg, sizeof(vm->reg));
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    vm->snapshot = snap;
+    vm->halted = 0;
+    interrupt_update(vm);
+}
+
+// IDLE DETECTION
+// A guest waiting for a key spins on a load of MR_KBSR and a branch back.
+// Once IDLE_SPINS empty polls in a row come from the same PC, a few
+// instructions apart, and the loop around that PC holds nothing but
+// register operations, loads and branches (no stores, calls or traps), the
+// VM parks in input_wait() instead of burning the core. The timeout keeps a
+// parked guest making slow progress in case it is counting polls. A guest
+// waiting for a keyboard interrupt is found the same way at its taken
+// branches, but its loop may only load and branch: with no arithmetic,
+// nothing but the interrupt handler can change what it sees.
+enum
+{
+    IDLE_SPINS = 64,        // empty polls before parking
+    IDLE_WINDOW = 16,       // max instructions per loop iteration
+    IDLE_TIMEOUT_MS = 100
+};
+
+// the loop that polls at pc only reads and branches back over itself;
+// without alu, register operations other than LEA end the search too
+int idle_loop(struct vm* vm, uint16_t pc, int alu)
+{
+    for (int i = 0; i < IDLE_WINDOW; ++i)
+    {
+        uint16_t at = pc + i;
+        uint16_t instr = vm->memory[at];
+        if (instr >> 12 != OP_BR || !((instr >> 9) & 0x7))
+        {
+            continue;
+        }
+        uint16_t target = at + 1 + sign_extend(instr & 0x1FF, 9);
+        if ((uint16_t)(pc - target) >= IDLE_WINDOW)
+        {
+            return 0; // first real branch does not close a loop around pc
+        }
+        for (uint16_t a = target; a != at; ++a)
+        {
+            switch (vm->memory[a] >> 12)
+            {
+                case OP_ADD: case OP_AND: case OP_NOT:
+                    if (!alu) return 0;
+                    break;
+                case OP_BR: case OP_LD: case OP_LDI: case OP_LDR: case OP_LEA:
+                    break;
+                default:
+                    return 0;
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// called on every empty KBSR poll, returns 1 when the VM should park
+int idle_poll(struct vm* vm, uint16_t pc, int alu)
+{
+    if (pc != vm->idle_pc || vm->instr_count - vm->idle_at > IDLE_WINDOW)
+    {
+        vm->idle_pc = pc;
+        vm->idle_spins = 0;
+    }
+    vm->idle_at = vm->instr_count;
+    if (++vm->idle_spins < IDLE_SPINS)
+    {
+        return 0;
+    }
+    vm->idle_spins = 0;
+    return idle_loop(vm, pc, alu);
+}
+
+// DEVICES
+// keyboard: a key is latched in KBDR with KBSR_READY set until the guest
+// reads KBDR; a KBSR read or the interrupt check latches the next one
+int keyboard_latch(struct vm* vm)
+{
+    uint16_t* memory = vm->memory;
+    if (!(memory[MR_KBSR] & KBSR_READY) && input_available(vm))
+    {
+        vm->dirty[MR_KBSR >> PAGE_SHIFT] = 1;
+        memory[MR_KBSR] |= KBSR_READY;
+        memory[MR_KBDR] = input_getc(vm); // read the character
+    }
+    return memory[MR_KBSR] >> 15;
+}
+
+uint16_t keyboard_read(struct vm* vm, uint16_t address)
+{
+    uint16_t* memory = vm->memory;
+    if (vm->counters)
+    {
+        vm->counters->kbsr_reads += address == MR_KBSR;
+        vm->counters->kbdr_reads += address == MR_KBDR;
+    }
+    if (address == MR_KBSR)
+    {
+        // reg[R_PC] is one past the polling instruction in both engines
+        if (!(memory[MR_KBSR] & KBSR_READY) && !vm->replay && !input_available(vm)
+            && idle_poll(vm, vm->reg[R_PC] - 1, 1))
+        {
+            ++vm->idle_parks;
+            input_wait(vm, IDLE_TIMEOUT_MS);
+        }
+        if (!keyboard_latch(vm) && vm->out_len)
+        {
+            out_flush(vm); // polling counts as waiting for input
+        }
+    }
+    else
+    {
+        vm->dirty[MR_KBSR >> PAGE_SHIFT] = 1;
+        memory[MR_KBSR] &= ~KBSR_READY;
+    }
+    return memory[address];
+}
+
+// only KBSR_IE can be written
+void keyboard_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    if (address == MR_KBSR)
+    {
+        vm->memory[MR_KBSR] = (vm->memory[MR_KBSR] & KBSR_READY) | (val & KBSR_IE);
+        interrupt_update(vm);
+    }
+}
+
+// Text framebuffer: FB_ROWS x FB_COLS cells from MR_FB, each a character in
+// the low byte and FB_* attribute bits above it. A write to MR_FBCR presents
+// the frame: only cells that differ from the last presented frame are sent,
+// as runs with one cursor move each and SGR codes only where the attribute
+// changes, and the whole update goes out in a single write.
+void fb_cell(struct vm* vm, uint16_t cell, int* attr)
+{
+    int a = cell & FB_COLOR ? cell & (FB_COLOR | FB_BOLD | FB_FG) : 0;
+    if (a != *attr)
+    {
+        char sgr[16];
+        if (!a)
+        {
+            out_puts(vm, "\x1b[0m");
+        }
+        else
+        {
+            snprintf(sgr, sizeof(sgr), "\x1b[%s3%dm", a & FB_BOLD ? "1;" : "0;", (a & FB_FG) >> 8);
+            out_puts(vm, sgr);
+        }
+        *attr = a;
+    }
+    char c = cell & 0xFF;
+    out_putc(vm, c >= ' ' && c < 0x7F ? c : ' ');
+}
+
+void fb_present(struct vm* vm)
+{
+    const uint16_t* cells = vm->memory + MR_FB;
+    int first = !vm->fb_shown;
+    if (first)
+    {
+        vm->fb_shown = malloc(FB_CELLS * sizeof(uint16_t));
+        out_puts(vm, "\x1b[2J");
+    }
+    uint16_t* shown = vm->fb_shown;
+    int attr = -1;   // terminal attributes are unknown until the first SGR
+    int cursor = -1; // cell the terminal cursor is on, -1 when unknown
+    int sent = 0;
+    for (int i = 0; i < FB_CELLS; ++i)
+    {
+        if (!first && cells[i] == shown[i])
+        {
+            continue;
+        }
+        int gap = i - cursor;
+        int same_row = cursor >= 0 && cursor / FB_COLS == i / FB_COLS;
+        if (same_row && gap <= FB_BRIDGE)
+        {
+            // rewriting a few unchanged cells is shorter than a cursor move
+            for (; cursor < i; ++cursor)
+            {
+                fb_cell(vm, cells[cursor], &attr);
+            }
+        }
+        else if (cursor != i)
+        {
+            char move[16];
+            snprintf(move, sizeof(move), "\x1b[%d;%dH", i / FB_COLS + 1, i % FB_COLS + 1);
+            out_puts(vm, move);
+        }
+        fb_cell(vm, cells[i], &attr);
+        // past the last column the terminal may wrap or stay put, so the
+        // cursor is unknown until the next move
+        cursor = (i + 1) % FB_COLS ? i + 1 : -1;
+        sent = 1;
+    }
+    if (sent)
+    {
+        if (attr)
+        {
+            out_puts(vm, "\x1b[0m");
+        }
+        char move[16];
+        snprintf(move, sizeof(move), "\x1b[%d;1H", FB_ROWS + 1); // below the frame
+        out_puts(vm, move);
+        memcpy(shown, cells, FB_CELLS * sizeof(uint16_t));
+        out_flush(vm);
+    }
+}
+
+// display: always ready, a DDR write prints the low byte like TRAP_OUT
+uint16_t display_read(struct vm* vm, uint16_t address)
+{
+    return address == MR_DSR ? 1 << 15 : vm->memory[address];
+}
+
+void display_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    vm->memory[address] = val;
+    if (address == MR_DDR)
+    {
+        out_putc(vm, (char)val);
+        out_trap_done(vm);
+    }
+    else if (address == MR_FBCR)
+    {
+        fb_present(vm);
+    }
+}
+
+// timer: TSR reads bit 15 once for every interval that has passed
+uint16_t timer_read(struct vm* vm, uint16_t address)
+{
+    if (address == MR_TSR)
+    {
+        double now = now_seconds();
+        if (!vm->timer_ms || now < vm->timer_due)
+        {
+            return 0;
+        }
+        vm->timer_due = now + vm->timer_ms / 1000.0;
+        return 1 << 15;
+    }
+    return vm->timer_ms;
+}
+
+void timer_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    if (address == MR_TMI)
+    {
+        vm->timer_ms = val;
+        vm->timer_due = now_seconds() + val / 1000.0;
+    }
+}
+
+// machine control: bit 15 is the clock enable, the rest is plain storage
+uint16_t mcr_read(struct vm* vm, uint16_t address)
+{
+    return (vm->memory[MR_MCR] & 0x7FFF) | (vm->halted ? 0 : 1 << 15);
+}
+
+void mcr_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    vm->memory[MR_MCR] = val;
+    vm->halted = !(val >> 15);
+}
+
+// processor status: R_PSR with the condition codes in bits 2-0
+uint16_t psr_read(struct vm* vm, uint16_t address)
+{
+    return vm->reg[R_PSR] | cond_flags(vm);
+}
+
+void psr_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    vm->reg[R_PSR] = val & (PSR_USER | PSR_PRIORITY);
+    set_cond_flags(vm, val);
+    interrupt_update(vm);
+}
+
+const struct device keyboard_device = { "keyboard", keyboard_read, keyboard_write };
+const struct device display_device = { "display", display_read, display_write };
+const struct device timer_device = { "timer", timer_read, timer_write };
+const struct device mcr_device = { "machine control", mcr_read, mcr_write };
+const struct device psr_device = { "processor status", psr_read, psr_write };
+
+void vm_map_device(struct vm* vm, uint16_t address, const struct device* dev)
+{
+    struct io_page** page = &vm->io[address >> PAGE_SHIFT];
+    if (!*page)
+    {
+        *page = calloc(1, sizeof(struct io_page));
+    }
+    (*page)->device[address & (PAGE_SIZE - 1)] = dev;
+}
+
+void vm_map_devices(struct vm* vm)
+{
+    vm_map_device(vm, MR_KBSR, &keyboard_device);
+    vm_map_device(vm, MR_KBDR, &keyboard_device);
+    vm_map_device(vm, MR_DSR, &display_device);
+    vm_map_device(vm, MR_DDR, &display_device);
+    vm_map_device(vm, MR_FBCR, &display_device);
+    vm_map_device(vm, MR_TSR, &timer_device);
+    vm_map_device(vm, MR_TMI, &timer_device);
+    vm_map_device(vm, MR_MCR, &mcr_device);
+    vm_map_device(vm, MR_PSR, &psr_device);
+}
+
+uint16_t mem_read(struct vm* vm, uint16_t address)
+{
+    if (vm->io[address >> PAGE_SHIFT])
+    {
+        const struct device* dev = device_at(vm, address);
+        if (dev && dev->read)
+        {
+            return dev->read(vm, address);
+        }
+    }
+    return vm->memory[address];
+}
+
+// INTERRUPTS
+// The LC-3 interrupt model for the keyboard. With KBSR_IE set, a ready key
+// interrupts a program running below PL_KEYBOARD: PSR and PC are pushed on
+// the supervisor stack (switched to from R6 in user mode), the PSR drops to
+// supervisor mode at the keyboard's priority and execution continues at the
+// handler in the vector table. RTI pops them again. Machines start in user
+// mode at priority 0. Both engines only check for the interrupt right after
+// a taken BR, JMP, JSR/JSRR or TRAP, and only while vm->interrupts says one
+// could be taken, so a key is taken at the same retired instruction either
+// way and record/replay stays exact. RTI is not a check point: the
+// interrupted program always gets to run before the next interrupt. End of
+// input is delivered like a key, as xFFFF.
+void interrupt_update(struct vm* vm)
+{
+    int priority = (vm->reg[R_PSR] & PSR_PRIORITY) >> PSR_PRIORITY_SHIFT;
+    vm->interrupts = (vm->memory[MR_KBSR] & KBSR_IE) && priority < PL_KEYBOARD;
+}
+
+// a push onto the supervisor stack may land on code like any other store
+void interrupt_push(struct vm* vm, uint16_t val)
+{
+    uint16_t a = --vm->reg[R_R6];
+    mem_write(vm, a, val);
+    if (vm->jit && jit_compiled(vm->jit, a))
+    {
+        jit_flush(vm->jit);
+    }
+}
+
+void interrupt_enter(struct vm* vm, uint16_t vector, int priority)
+{
+    uint16_t* reg = vm->reg;
+    uint16_t psr = psr_read(vm, MR_PSR);
+    if (psr & PSR_USER)
+    {
+        reg[R_SAVED_USP] = reg[R_R6];
+        reg[R_R6] = reg[R_SAVED_SSP];
+    }
+    interrupt_push(vm, psr);
+    interrupt_push(vm, reg[R_PC]);
+    reg[R_PSR] = priority << PSR_PRIORITY_SHIFT;
+    reg[R_PC] = mem_read(vm, INT_TABLE + vector);
+    interrupt_update(vm);
+}
+
+// called at a taken control transfer while vm->interrupts is set
+void interrupt_check(struct vm* vm)
+{
+    if (keyboard_latch(vm))
+    {
+        interrupt_enter(vm, INT_KEYBOARD, PL_KEYBOARD);
+    }
+    else if (!vm->replay && idle_poll(vm, vm->reg[R_PC], 0))
+    {
+        ++vm->idle_parks;
+        input_wait(vm, IDLE_TIMEOUT_MS); // the next check takes the key
+    }
+}
+
+// RTI in user mode or the reserved opcode: run the guest's handler, or stop
+// the machine if it has none. Returns 0 when the machine stopped.
+int execute_exception(struct vm* vm, uint16_t vector)
+{
+    if (!vm->memory[INT_TABLE + vector])
+    {
+        out_flush(vm);
+        fprintf(stderr, "%s at x%04X\n", vector == EXC_PRIVILEGE ? "RTI in user mode" : "illegal opcode",
+                (uint16_t)(vm->reg[R_PC] - 1));
+        return 0;
+    }
+    interrupt_enter(vm, vector, (vm->reg[R_PSR] & PSR_PRIORITY) >> PSR_PRIORITY_SHIFT);
+    return 1;
+}
+
+int execute_rti(struct vm* vm)
+{
+    uint16_t* reg = vm->reg;
+    if (reg[R_PSR] & PSR_USER)
+    {
+        return execute_exception(vm, EXC_PRIVILEGE);
+    }
+    reg[R_PC] = mem_read(vm, reg[R_R6]);
+    uint16_t psr = mem_read(vm, reg[R_R6] + 1);
+    reg[R_R6] += 2;
+    reg[R_PSR] = psr & (PSR_USER | PSR_PRIORITY);
+    set_cond_flags(vm, psr);
+    if (psr & PSR_USER)
+    {
+        reg[R_SAVED_SSP] = reg[R_R6];
+        reg[R_R6] = reg[R_SAVED_USP];
+    }
+    interrupt_update(vm);
+    return 1;
+}
+
+// WAIT
+// TRAP_WAIT sleeps until a key is waiting, the timer is due or the process
+// got SIGUSR2, and returns the WAIT_* bits of whatever it was in R0; it
+// consumes none of them. End of input wakes it until the guest has read it.
+// Signals are counted, so one sent just before the WAIT is not lost; a
+// sleeping WAIT notices them within WAIT_SLICE_MS. Under --replay it never
+// sleeps and may return 0. In batch mode a WAIT that would sleep leaves
+// run() with vm->suspended set instead, so the worker thread can run other
+// instances until this one has something to wake up for.
+enum
+{
+    WAIT_KEY = 1 << 0,
+    WAIT_TIMER = 1 << 1,
+    WAIT_SIGNAL = 1 << 2,
+    WAIT_SLICE_MS = 50
+};
+
+// what a WAIT would return now, 0 to keep sleeping
+uint16_t wait_events(struct vm* vm)
+{
+    uint16_t events = 0;
+    // after EOF with no timer running nothing could wake the guest, so the
+    // end of input counts as a key again
+    if ((vm->memory[MR_KBSR] & KBSR_READY) || (!vm->input_done && input_available(vm))
+        || (vm->input_done && !vm->timer_ms))
+    {
+        events |= WAIT_KEY;
+    }
+    if (vm->timer_ms && now_seconds() >= vm->timer_due)
+    {
+        events |= WAIT_TIMER;
+    }
+    if (vm->wake_seen != atomic_load(&wake_signals))
+    {
+        events |= WAIT_SIGNAL;
+    }
+    return events;
+}
+
+// how long to sleep before looking at the events again
+int wait_timeout_ms(struct vm* vm)
+{
+    int ms = WAIT_SLICE_MS;
+    if (vm->timer_ms)
+    {
+        double due = (vm->timer_due - now_seconds()) * 1000 + 1;
+        ms = due < ms ? (due > 0 ? (int)due : 0) : ms;
+    }
+    return ms;
+}
+
+void wait_finish(struct vm* vm, uint16_t events)
+{
+    if (events & WAIT_SIGNAL)
+    {
+        vm->wake_seen = atomic_load(&wake_signals);
+    }
+    vm->reg[R_R0] = events;
+    update_flags(vm, R_R0);
+}
+
+// returns 0 when the machine suspended instead of sleeping
+int execute_wait(struct vm* vm)
+{
+    uint16_t events = wait_events(vm);
+    if (!events && !vm->replay)
+    {
+        if (vm->yield_waits)
+        {
+            out_flush(vm);
+            vm->suspended = 1;
+            return 0;
+        }
+        do {
+            if (vm->input_done)
+            {
+                // input_wait() returns at once after EOF
+                out_flush(vm);
+                double start = now_seconds();
+                vm->waiting = 1;
+                usleep(wait_timeout_ms(vm) * 1000);
+                vm->waiting = 0;
+                vm->idle_seconds += now_seconds() - start;
+            }
+            else
+            {
+                input_wait(vm, wait_timeout_ms(vm));
+            }
+        } while (!(events = wait_events(vm)));
+    }
+    wait_finish(vm, events);
+    return 1;
+}
+
+// continue a suspended machine once wait_events() has something for it: the
+// WAIT returns, and the check for an interrupt after a TRAP happens here
+void wait_resume(struct vm* vm, uint16_t events)
+{
+    vm->suspended = 0;
+    wait_finish(vm, events);
+    if (vm->interrupts)
+    {
+        interrupt_check(vm);
+    }
+}
+
+// TRAP ROUTINES
+// returns 0 once the guest has halted, or suspended in a WAIT
+int execute_trap(struct vm* vm, uint16_t vector)
+{
+    uint16_t* reg = vm->reg;
+    uint16_t* memory = vm->memory;
+
+    if (vm->counters)
+    {
+        if (vector >= TRAP_GETC && vector <= TRAP_WAIT)
+        {
+            ++vm->counters->traps[vector - TRAP_GETC];
+        }
+        else
+        {
+            ++vm->counters->bad_traps;
+        }
+    }
+
+    switch (vector)
+    {
+        case TRAP_GETC: // read a single ASCII char
+            {
+                reg[R_R0] = (uint16_t)input_getc(vm);
+                update_flags(vm, R_R0);
+                break;
+            }
+        case TRAP_OUT: // output a character
+            {
+                out_putc(vm, (char)reg[R_R0]);
+                out_trap_done(vm);
+                break;
+            }
+        case TRAP_PUTS: // output a null terminated string
+            {
+                uint16_t* c = memory + reg[R_R0];
+                while (*c)
+                {
+                    out_putc(vm, (char)*c);
+                    ++c;
+                }
+                out_trap_done(vm);
+                break;
+            }
+        case TRAP_IN: // input character
+            {
+                out_puts(vm, "*** Enter a character: ");
+                char c = input_getc(vm);
+                out_puts(vm, "\nRead character: "); // Debug print
+                out_putc(vm, c);
+                out_putc(vm, '\n');
+                out_putc(vm, c);
+                out_trap_done(vm);
+                reg[R_R0] = (uint16_t)c;
+                update_flags(vm, R_R0);
+                break;
+
+            }
+        case TRAP_PUTSP: // output string
+            {
+                /* one char per byte (two bytes per word)
+                here we need to swap back to big endian format */
+                uint16_t* c = memory + reg[R_R0];
+                while (*c)
+                {
+                    char char1 = (*c) & 0xFF;
+                    out_putc(vm, char1);
+                    char char2 = (*c) >> 8;
+                    if (char2) out_putc(vm, char2);
+                    ++c;
+                }
+                out_trap_done(vm);
+                break;
+            }
+        case TRAP_HALT: // halt program
+            {
+                out_puts(vm, "Thanks for playing!\n");
+                ++vm->out_flush_points;
+                out_flush(vm);
+                return 0;
+            }
+        case TRAP_WAIT: // sleep until something happens
+            {
+                return execute_wait(vm);
+            }
+    }
+    return 1;
+}
+
+// INTRINSICS
+// LC-3 has no multiply, divide or shift, so guests carry loops for them.
+// With --intrinsics, a JSR to one of the routines below, word for word, runs
+// a C version instead. The words at a JSR target are fingerprinted when the
+// JSR is decoded or compiled and looked up in the library, and the match is
+// confirmed again on every call, so a routine overwritten since then simply
+// runs as guest code. The C version leaves registers, condition codes, memory
+// (the words the routine saves below R6 included) and output exactly as the
+// guest code would, and retires the same number of instructions, so
+// --record/--replay and --stats see no difference. A call stays guest code
+// while the profiler, the sampler or --counters watch single instructions,
+// while an interrupt could arrive halfway through it, and when it would touch
+// a device page or store into the routine itself. --intrinsics=check also
+// runs the guest code of every call on a scratch machine and compares; a
+// routine that differs is reported and left to the guest from then on.
+enum
+{
+    NATIVE_STACK = 6,          // words below R6 any library routine saves registers in
+    NATIVE_CHECK_LIMIT = 1 << 24 // guest instructions a checked call may take
+};
+
+struct intrinsic
+{
+    const char* name;
+    uint32_t fingerprint;       // native_fingerprint() of code
+    const uint16_t* code;
+    uint16_t length;            // words, data and unreachable tails included
+    uint64_t (*run)(struct vm* vm); // instructions the guest code retires, 0 to leave the call to it
+};
+
+// 2048.obj's multiply at x32E3: R0 = (R0 & x7FFF) * R1
+const uint16_t native_mul_code[] = {
+    0x1020, 0x0416, 0x1260, 0x0414, 0x73BF, 0x75BE, 0x77BD, 0x79BC,
+    0x1DBC, 0x54A0, 0x16A1, 0x5803, 0x0C01, 0x1481, 0x1241, 0x16C3,
+    0x03FA, 0x10A0, 0x6980, 0x6781, 0x6582, 0x6383, 0x1DA4, 0xC1C0,
+    0x5020, 0xC1C0
+};
+
+// 2048.obj's division at x32CF: R0 = R0 mod R1, R1 = R0 / R1; HALTs on zero
+const uint16_t native_divmod_code[] = {
+    0x73BF, 0x75BE, 0x77BD, 0x1DBD, 0x947F, 0x14A1, 0x040C, 0x5260,
+    0x1261, 0x1002, 0x03FD, 0x0403, 0x6582, 0x127F, 0x1002, 0x6780,
+    0x6581, 0x1DA3, 0xC1C0, 0xF025
+};
+
+// the rest are LSHIFT, RSHIFT, PRINTD and MEMCPY in bench/mathlib.asm
+const uint16_t native_lshift_code[] = {
+    0x73BF, 0x1DBF, 0x1260, 0x0C03, 0x1000, 0x127F, 0x03FD, 0x6380,
+    0x1DA1, 0xC1C0
+};
+
+const uint16_t native_rshift_code[] = {
+    0x73BF, 0x75BE, 0x77BD, 0x79BC, 0x1DBC, 0x54A0, 0x56E0, 0x16E1,
+    0x1260, 0x0C04, 0x16C3, 0x040A, 0x127F, 0x03FC, 0x5260, 0x1261,
+    0x5803, 0x0401, 0x1481, 0x1241, 0x16C3, 0x0BFA, 0x10A0, 0x6980,
+    0x6781, 0x6582, 0x6383, 0x1DA4, 0xC1C0
+};
+
+const uint16_t native_printd_code[] = {
+    0x7FBF, 0x79BE, 0x77BD, 0x75BC, 0x73BB, 0x71BA, 0x1DBA, 0x1220,
+    0x0604, 0x2021, 0xF021, 0x927F, 0x1261, 0xE41F, 0x5920, 0x6680,
+    0x040F, 0x5020, 0x1243, 0x0802, 0x1021, 0x0FFC, 0x96FF, 0x16E1,
+    0x1243, 0x1900, 0x0403, 0x2610, 0x1003, 0xF021, 0x14A1, 0x0FEF,
+    0x260B, 0x1043, 0xF021, 0x6180, 0x6381, 0x6582, 0x6783, 0x6984,
+    0x6F85, 0x1DA6, 0xC1C0, 0x002D, 0x0030, 0xD8F0, 0xFC18, 0xFF9C,
+    0xFFF6, 0x0000
+};
+
+const uint16_t native_memcpy_code[] = {
+    0x71BF, 0x73BE, 0x75BD, 0x77BC, 0x1DBC, 0x14A0, 0x0C06, 0x6640,
+    0x7600, 0x1021, 0x1261, 0x14BF, 0x03FA, 0x6780, 0x6581, 0x6382,
+    0x6183, 0x1DA4, 0xC1C0
+};
+
+// FNV-1a over the words as they are stored in an image, high byte first
+uint32_t native_fingerprint(const uint16_t* words, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; ++i)
+    {
+        hash = (hash ^ (words[i] >> 8)) * 16777619u;
+        hash = (hash ^ (words[i] & 0xFF)) * 16777619u;
+    }
+    return hash;
+}
+
+// 1 when address .. address + count - 1 is plain memory outside the length
+// words at entry, so a store there reaches no device and no routine code
+int native_plain(struct vm* vm, uint16_t address, uint16_t count, uint16_t entry, uint16_t length)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint16_t a = address + i;
+        if (vm->io[a >> PAGE_SHIFT] || (uint16_t)(a - entry) < length)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// a store the routine makes, kept coherent with decoded and compiled code
+void native_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    mem_write(vm, address, val);
+    if (vm->jit && jit_compiled(vm->jit, address))
+    {
+        jit_flush(vm->jit);
+    }
+}
+
+// the STRs of a prologue that saves regs[0] at R6 - 1, regs[1] at R6 - 2...
+void native_save(struct vm* vm, const uint8_t* regs, int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        native_write(vm, vm->reg[R_R6] - 1 - i, vm->reg[regs[i]]);
+    }
+}
+
+// and the LDRs that load them back
+void native_restore(struct vm* vm, const uint8_t* regs, int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        vm->reg[regs[i]] = vm->memory[(uint16_t)(vm->reg[R_R6] - 1 - i)];
+    }
+}
+
+// TRAP x21, for routines that print
+void native_putc(struct vm* vm, char c)
+{
+    out_putc(vm, c);
+    out_trap_done(vm);
+}
+
+uint64_t native_mul(struct vm* vm)
+{
+    static const uint8_t saved[] = { R_R1, R_R2, R_R3, R_R4 };
+    uint16_t* reg = vm->reg;
+    if (!reg[R_R0] || !reg[R_R1])
+    {
+        uint64_t count = reg[R_R0] ? 6 : 4;
+        reg[R_R0] = 0;
+        update_flags(vm, R_R0);
+        return count;
+    }
+    native_save(vm, saved, 4);
+    uint16_t bits = reg[R_R0] & 0x7FFF; // the loop stops before bit 15
+    reg[R_R0] = bits * reg[R_R1];
+    native_restore(vm, saved, 4);
+    update_flags(vm, R_R6);
+    return 93 + __builtin_popcount(bits);
+}
+
+uint64_t native_divmod(struct vm* vm)
+{
+    static const uint8_t saved[] = { R_R1, R_R2, R_R3 };
+    uint16_t* reg = vm->reg;
+    uint16_t a = reg[R_R0];
+    uint16_t d = reg[R_R1];
+    if (!d)
+    {
+        return 0; // the guest code halts
+    }
+    native_save(vm, saved, 3);
+
+    // R1 counts subtractions until R0 is no longer positive
+    uint32_t q;
+    uint16_t r;
+    if ((int16_t)a > 0 && (int16_t)d > 0)
+    {
+        q = (a + d - 1) / d;
+        r = a - q * d;
+    }
+    else
+    {
+        q = 0; // follow the loop through the wrap-around
+        r = a;
+        do {
+            ++q;
+            r -= d;
+        } while ((int16_t)r > 0);
+    }
+    uint64_t count = 13 + 3 * (uint64_t)q;
+    if (r)
+    {
+        r += vm->memory[(uint16_t)(reg[R_R6] - 1)]; // the saved divisor
+        --q;
+        count += 3;
+    }
+    reg[R_R0] = r;
+    reg[R_R1] = q; // the only saved register not loaded back
+    reg[R_R3] = vm->memory[(uint16_t)(reg[R_R6] - 3)];
+    reg[R_R2] = vm->memory[(uint16_t)(reg[R_R6] - 2)];
+    update_flags(vm, R_R6);
+    return count;
+}
+
+uint64_t native_lshift(struct vm* vm)
+{
+    static const uint8_t saved[] = { R_R1 };
+    uint16_t* reg = vm->reg;
+    uint16_t n = (int16_t)reg[R_R1] > 0 ? reg[R_R1] : 0;
+    native_save(vm, saved, 1);
+    reg[R_R0] = n < 16 ? reg[R_R0] << n : 0;
+    native_restore(vm, saved, 1);
+    update_flags(vm, R_R6);
+    return 7 + 3 * (uint64_t)n;
+}
+
+uint64_t native_rshift(struct vm* vm)
+{
+    static const uint8_t saved[] = { R_R1, R_R2, R_R3, R_R4 };
+    uint16_t* reg = vm->reg;
+    int16_t n = reg[R_R1];
+    uint64_t count = 17;
+    native_save(vm, saved, 4);
+    if (n >= 16)
+    {
+        reg[R_R0] = 0;
+        count += 62; // the skip loop runs out of source bits
+    }
+    else
+    {
+        int s = n > 0 ? n : 0;
+        reg[R_R0] >>= s;
+        count += 4 * s + 2 + 5 * (16 - s) + __builtin_popcount(reg[R_R0]);
+    }
+    native_restore(vm, saved, 4);
+    update_flags(vm, R_R6);
+    return count;
+}
+
+uint64_t native_printd(struct vm* vm)
+{
+    static const uint8_t saved[] = { R_R7, R_R4, R_R3, R_R2, R_R1, R_R0 };
+    static const uint16_t tens[] = { 10000, 1000, 100, 10 };
+    uint16_t* reg = vm->reg;
+    uint16_t value = reg[R_R0];
+    uint32_t left = value;
+    uint64_t count = 24;
+    native_save(vm, saved, 6);
+    if (value >> 15)
+    {
+        native_putc(vm, '-');
+        left = (uint16_t)-value;
+        count += 4;
+    }
+    unsigned digits = 0; // the guest's R4: leading zeros are skipped until it is nonzero
+    for (int i = 0; i < 4; ++i)
+    {
+        unsigned digit = left / tens[i];
+        left %= tens[i];
+        digits += digit;
+        count += 12 + 4 * digit;
+        if (digits)
+        {
+            native_putc(vm, '0' + digit);
+            count += 3;
+        }
+    }
+    native_putc(vm, '0' + left);
+    native_restore(vm, saved, 6);
+    update_flags(vm, R_R6);
+    return count;
+}
+
+uint64_t native_memcpy(struct vm* vm)
+{
+    static const uint8_t saved[] = { R_R0, R_R1, R_R2, R_R3 };
+    uint16_t* reg = vm->reg;
+    uint16_t to = reg[R_R0];
+    uint16_t from = reg[R_R1];
+    uint16_t n = (int16_t)reg[R_R2] > 0 ? reg[R_R2] : 0;
+    uint16_t length = sizeof(native_memcpy_code) / sizeof(uint16_t);
+    if (!native_plain(vm, from, n, 0, 0) || !native_plain(vm, to, n, reg[R_PC], length))
+    {
+        return 0;
+    }
+    native_save(vm, saved, 4);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        native_write(vm, to + i, vm->memory[(uint16_t)(from + i)]); // overlapping copies see earlier stores
+    }
+    native_restore(vm, saved, 4);
+    update_flags(vm, R_R6);
+    return 13 + 6 * (uint64_t)n;
+}
+
+#define INTRINSIC(name, fingerprint) \
+    { #name, fingerprint, native_##name##_code, sizeof(native_##name##_code) / sizeof(uint16_t), native_##name }
+
+const struct intrinsic intrinsics[] = {
+    INTRINSIC(mul, 0xF9FEEAA6),
+    INTRINSIC(divmod, 0x11C2265D),
+    INTRINSIC(lshift, 0x8AC0F15B),
+    INTRINSIC(rshift, 0x05844DED),
+    INTRINSIC(printd, 0xEA4CE5E4),
+    INTRINSIC(memcpy, 0x8D18444C)
+};
+
+#undef INTRINSIC
+
+enum { INTRINSIC_COUNT = sizeof(intrinsics) / sizeof(intrinsics[0]) };
+
+int native_intact(struct vm* vm, const struct intrinsic* in, uint16_t entry)
+{
+    return entry + in->length <= MR_KBSR
+        && memcmp(vm->memory + entry, in->code, in->length * sizeof(uint16_t)) == 0;
+}
+
+// the library routine at address, -1 for none
+int native_find(struct vm* vm, uint16_t address)
+{
+    for (int i = 0; i < INTRINSIC_COUNT; ++i)
+    {
+        const struct intrinsic* in = &intrinsics[i];
+        if (address + in->length <= MR_KBSR
+            && native_fingerprint(vm->memory + address, in->length) == in->fingerprint
+            && native_intact(vm, in, address))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// scratch machine i holding a copy of vm's registers and memory
+struct vm* native_scratch(struct vm* vm, int i)
+{
+    struct vm* s = vm->native_scratch[i];
+    if (!s)
+    {
+        s = vm->native_scratch[i] = vm_create();
+        s->out_capture = 1;
+    }
+    memcpy(s->reg, vm->reg, sizeof(s->reg));
+    memcpy(s->memory, vm->memory, MEMORY_MAX * sizeof(uint16_t));
+    s->instr_count = 0;
+    s->out_len = 0;
+    s->capture_len = 0;
+    return s;
+}
+
+// Run the guest code of a routine on s until it returns to ret: instructions
+// retired, 0 if it halted, hit RTI or the reserved opcode, or ran too long.
+uint64_t native_reference(struct vm* s, uint16_t ret)
+{
+    uint16_t* reg = s->reg;
+    uint64_t n = 0;
+    while (reg[R_PC] != ret)
+    {
+        if (++n > NATIVE_CHECK_LIMIT)
+        {
+            return 0;
+        }
+        struct decoded d;
+        uint16_t pc = reg[R_PC]++;
+        decode_word(&d, s->memory[pc], pc);
+        switch (d.op)
+        {
+            case OP_ADD: reg[d.r0] = reg[d.r1] + reg[d.r2]; update_flags(s, d.r0); break;
+            case OP_ADDI: reg[d.r0] = reg[d.r1] + d.imm; update_flags(s, d.r0); break;
+            case OP_AND: reg[d.r0] = reg[d.r1] & reg[d.r2]; update_flags(s, d.r0); break;
+            case OP_ANDI: reg[d.r0] = reg[d.r1] & d.imm; update_flags(s, d.r0); break;
+            case OP_NOT: reg[d.r0] = ~reg[d.r1]; update_flags(s, d.r0); break;
+            case OP_BR: if (d.r0 & cond_flags(s)) reg[R_PC] = d.imm; break;
+            case OP_JMP: reg[R_PC] = reg[d.r1]; break;
+            case OP_JSR: reg[R_R7] = reg[R_PC]; reg[R_PC] = d.imm; break;
+            case OP_JSRR: { uint16_t t = reg[d.r1]; reg[R_R7] = reg[R_PC]; reg[R_PC] = t; break; }
+            case OP_LD: reg[d.r0] = mem_read(s, d.imm); update_flags(s, d.r0); break;
+            case OP_LDI: reg[d.r0] = mem_read(s, mem_read(s, d.imm)); update_flags(s, d.r0); break;
+            case OP_LDR: reg[d.r0] = mem_read(s, reg[d.r1] + d.imm); update_flags(s, d.r0); break;
+            case OP_LEA: reg[d.r0] = d.imm; update_flags(s, d.r0); break;
+            case OP_ST: mem_write(s, d.imm, reg[d.r0]); break;
+            case OP_STI: mem_write(s, mem_read(s, d.imm), reg[d.r0]); break;
+            case OP_STR: mem_write(s, reg[d.r1] + d.imm, reg[d.r0]); break;
+            case OP_TRAP:
+                reg[R_R7] = reg[R_PC];
+                if (!execute_trap(s, d.imm))
+                {
+                    return 0;
+                }
+                break;
+            default:
+                return 0;
+        }
+    }
+    return n;
+}
+
+// Run routine in natively on one scratch copy of vm and as guest code on
+// another. Returns 1 when they agree or the native version declined, so the
+// call can go ahead natively; otherwise reports what differs.
+int native_check(struct vm* vm, const struct intrinsic* in)
+{
+    struct vm* a = native_scratch(vm, 0);
+    uint64_t count = in->run(a);
+    if (!count)
+    {
+        return 1;
+    }
+    a->reg[R_PC] = a->reg[R_R7];
+    out_flush(a);
+    struct vm* b = native_scratch(vm, 1);
+    uint64_t steps = native_reference(b, vm->reg[R_R7]);
+    out_flush(b);
+
+    char what[64] = "";
+    if (!steps)
+    {
+        snprintf(what, sizeof(what), "the guest code did not return");
+    }
+    else if (count != steps)
+    {
+        snprintf(what, sizeof(what), "%llu instructions, guest %llu",
+                 (unsigned long long)count, (unsigned long long)steps);
+    }
+    for (int r = R_R0; r <= R_PC && !what[0]; ++r)
+    {
+        if (a->reg[r] != b->reg[r])
+        {
+            char name[4] = "PC";
+            if (r != R_PC)
+            {
+                snprintf(name, sizeof(name), "R%d", r - R_R0);
+            }
+            snprintf(what, sizeof(what), "%s x%04X, guest x%04X", name, a->reg[r], b->reg[r]);
+        }
+    }
+    if (!what[0] && cond_flags(a) != cond_flags(b))
+    {
+        snprintf(what, sizeof(what), "condition codes x%X, guest x%X", cond_flags(a), cond_flags(b));
+    }
+    for (int i = 0; i < MEMORY_MAX && !what[0]; ++i)
+    {
+        if (a->memory[i] != b->memory[i])
+        {
+            snprintf(what, sizeof(what), "x%04X at x%04X, guest x%04X", a->memory[i], i, b->memory[i]);
+        }
+    }
+    if (!what[0] && (a->capture_len != b->capture_len || memcmp(a->capture, b->capture, a->capture_len) != 0))
+    {
+        snprintf(what, sizeof(what), "%zu bytes of output, guest %zu", a->capture_len, b->capture_len);
+    }
+    if (!what[0])
+    {
+        return 1;
+    }
+    fprintf(stderr, "intrinsic %s at x%04X differs from the guest code: %s\n", in->name, vm->reg[R_PC], what);
+    return 0;
+}
+
+// A JSR has just set R7 and jumped to library routine index. Run it natively
+// and return to R7 as its RET would, or return 0 to leave it to the guest code.
+int native_call(struct vm* vm, int index)
+{
+    const struct intrinsic* in = &intrinsics[index];
+    uint16_t* reg = vm->reg;
+    uint16_t entry = reg[R_PC];
+    if (vm->interrupts || vm->profile || vm->sampler || vm->counters
+        || (vm->native_failed >> index & 1)
+        || !native_intact(vm, in, entry)
+        || !native_plain(vm, reg[R_R6] - NATIVE_STACK, NATIVE_STACK, entry, in->length))
+    {
+        return 0;
+    }
+    if (vm->intrinsics > 1 && !native_check(vm, in))
+    {
+        vm->native_failed |= 1u << index;
+        return 0;
+    }
+    uint64_t count = in->run(vm);
+    if (!count)
+    {
+        return 0;
+    }
+    vm->instr_count += count;
+    reg[R_PC] = reg[R_R7];
+    ++vm->native_calls;
+    return 1;
+}
+
+// PROFILER
+// --profile=FILE / --folded=FILE make the interpreter count executions per
+// PC and track guest subroutines: JSR/JSRR push a frame, a JMP R7 to the
+// return address of the top frame pops it. Retired instructions are charged
+// to the current node of a call tree as frames change, which gives the self
+// and total counts per subroutine in the report and one line per call path
+// in the folded stacks (the input format of flamegraph.pl).
+enum
+{
+    PROFILE_DEPTH = 256, // deeper calls are counted but not given their own frames
+    PROFILE_TOP = 30     // hot PCs listed in the report
+};
+
+struct profile_node
+{
+    uint16_t entry;  // subroutine address, the start PC for the root
+    int parent;
+    int child;       // first child
+    int sibling;     // next child of parent
+    uint64_t self;   // instructions retired while this was the innermost frame
+};
+
+struct profile
+{
+    uint64_t pc_hits[MEMORY_MAX];
+    uint64_t calls[MEMORY_MAX]; // per JSR/JSRR target
+    struct profile_node* nodes;
+    int node_count;
+    int node_cap;
+    int current;                // node of the innermost frame
+    uint64_t mark;              // instr_count when current was last charged
+    struct
+    {
+        int node;
+        uint16_t ret;
+    } stack[PROFILE_DEPTH];
+    int depth;
+    int overflow;               // calls beyond PROFILE_DEPTH
+};
+
+int profile_node(struct profile* prof, uint16_t entry, int parent)
+{
+    if (prof->node_count == prof->node_cap)
+    {
+        prof->node_cap = prof->node_cap ? prof->node_cap * 2 : 256;
+        prof->nodes = realloc(prof->nodes, prof->node_cap * sizeof(struct profile_node));
+    }
+    int n = prof->node_count++;
+    prof->nodes[n] = (struct profile_node){ entry, parent, -1, -1, 0 };
+    if (parent >= 0)
+    {
+        prof->nodes[n].sibling = prof->nodes[parent].child;
+        prof->nodes[parent].child = n;
+    }
+    return n;
+}
+
+struct profile* profile_create(uint16_t start)
+{
+    struct profile* prof = calloc(1, sizeof(struct profile));
+    prof->current = profile_node(prof, start, -1);
+    return prof;
+}
+
+void profile_destroy(struct profile* prof)
+{
+    free(prof->nodes);
+    free(prof);
+}
+
+void profile_charge(struct vm* vm)
+{
+    struct profile* prof = vm->profile;
+    prof->nodes[prof->current].self += vm->instr_count - prof->mark;
+    prof->mark = vm->instr_count;
+}
+
+// called after a JSR/JSRR has set R7 and the PC
+void profile_call(struct vm* vm)
+{
+    struct profile* prof = vm->profile;
+    uint16_t target = vm->reg[R_PC];
+    ++prof->calls[target];
+    if (prof->depth == PROFILE_DEPTH)
+    {
+        ++prof->overflow;
+        return;
+    }
+    profile_charge(vm);
+
+    int n = prof->nodes[prof->current].child;
+    while (n >= 0 && prof->nodes[n].entry != target)
+    {
+        n = prof->nodes[n].sibling;
+    }
+    if (n < 0)
+    {
+        n = profile_node(prof, target, prof->current);
+    }
+    prof->stack[prof->depth].node = prof->current;
+    prof->stack[prof->depth].ret = vm->reg[R_R7];
+    ++prof->depth;
+    prof->current = n;
+}
+
+// called after a JMP R7 has set the PC
+void profile_return(struct vm* vm)
+{
+    struct profile* prof = vm->profile;
+    if (prof->overflow)
+    {
+        --prof->overflow;
+        return;
+    }
+    if (prof->depth == 0 || prof->stack[prof->depth - 1].ret != vm->reg[R_PC])
+    {
+        return; // not a return from the top frame, just a jump through R7
+    }
+    profile_charge(vm);
+    prof->current = prof->stack[--prof->depth].node;
+}
+
+// instructions retired in node n and everything it called
+uint64_t profile_total(struct profile* prof, int n)
+{
+    uint64_t total = prof->nodes[n].self;
+    for (int c = prof->nodes[n].child; c >= 0; c = prof->nodes[c].sibling)
+    {
+        total += profile_total(prof, c);
+    }
+    return total;
+}
+
+// add up self and total per subroutine, not counting a recursive call twice
+void profile_sum(struct profile* prof, int n, uint64_t* self, uint64_t* total, uint16_t* active)
+{
+    uint16_t entry = prof->nodes[n].entry;
+    self[entry] += prof->nodes[n].self;
+    if (active[entry]++ == 0)
+    {
+        total[entry] += profile_total(prof, n);
+    }
+    for (int c = prof->nodes[n].child; c >= 0; c = prof->nodes[c].sibling)
+    {
+        profile_sum(prof, c, self, total, active);
+    }
+    --active[entry];
+}
+
+void profile_fold(struct profile* prof, int n, char* path, size_t len, FILE* out)
+{
+    len += sprintf(path + len, "%sx%04X", len ? ";" : "", prof->nodes[n].entry);
+    if (prof->nodes[n].self)
+    {
+        fprintf(out, "%s %llu\n", path, (unsigned long long)prof->nodes[n].self);
+    }
+    for (int c = prof->nodes[n].child; c >= 0; c = prof->nodes[c].sibling)
+    {
+        profile_fold(prof, c, path, len, out);
+    }
+}
+
+struct profile_row
+{
+    uint16_t address;
+    uint64_t count;
+    uint64_t total;
+};
+
+int profile_row_order(const void* a, const void* b)
+{
+    const struct profile_row* x = a;
+    const struct profile_row* y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+void profile_report(struct vm* vm, FILE* out)
+{
+    struct profile* prof = vm->profile;
+    double all = vm->instr_count ? (double)vm->instr_count : 1;
+    struct profile_row* rows = malloc(MEMORY_MAX * sizeof(struct profile_row));
+
+    fprintf(out, "instructions: %llu\n\n", (unsigned long long)vm->instr_count);
+    int n = 0;
+    for (int a = 0; a < MEMORY_MAX; ++a)
+    {
+        if (prof->pc_hits[a])
+        {
+            rows[n++] = (struct profile_row){ a, prof->pc_hits[a], 0 };
+        }
+    }
+    qsort(rows, n, sizeof(struct profile_row), profile_row_order);
+    fprintf(out, "hot instructions:\n%-8s %-8s %14s %8s\n", "pc", "word", "count", "percent");
+    for (int i = 0; i < n && i < PROFILE_TOP; ++i)
+    {
+        fprintf(out, "x%04X    x%04X    %14llu %7.2f%%\n", rows[i].address, vm->memory[rows[i].address],
+                (unsigned long long)rows[i].count, 100 * rows[i].count / all);
+    }
+
+    uint64_t* self = calloc(MEMORY_MAX, sizeof(uint64_t));
+    uint64_t* total = calloc(MEMORY_MAX, sizeof(uint64_t));
+    uint16_t* active = calloc(MEMORY_MAX, sizeof(uint16_t));
+    profile_charge(vm);
+    profile_sum(prof, 0, self, total, active);
+    n = 0;
+    for (int a = 0; a < MEMORY_MAX; ++a)
+    {
+        if (self[a] || total[a])
+        {
+            rows[n++] = (struct profile_row){ a, self[a], total[a] };
+        }
+    }
+    qsort(rows, n, sizeof(struct profile_row), profile_row_order);
+    fprintf(out, "\nsubroutines (by self instructions):\n%-8s %12s %14s %8s %14s %8s\n",
+            "entry", "calls", "self", "self%", "total", "total%");
+    for (int i = 0; i < n; ++i)
+    {
+        fprintf(out, "x%04X    %12llu %14llu %7.2f%% %14llu %7.2f%%\n", rows[i].address,
+                (unsigned long long)prof->calls[rows[i].address],
+                (unsigned long long)rows[i].count, 100 * rows[i].count / all,
+                (unsigned long long)rows[i].total, 100 * rows[i].total / all);
+    }
+
+    free(self);
+    free(total);
+    free(active);
+    free(rows);
+}
+
+void profile_write_folded(struct vm* vm, FILE* out)
+{
+    char path[PROFILE_DEPTH * 6 + 8];
+    profile_charge(vm);
+    profile_fold(vm->profile, 0, path, 0, out);
+}
+
+const char* profile_path; // --profile
+const char* folded_path;  // --folded
+
+void profile_save(struct vm* vm)
+{
+    if (!vm->profile)
+    {
+        return;
+    }
+    FILE* out;
+    if (profile_path && (out = fopen(profile_path, "w")))
+    {
+        profile_report(vm, out);
+        fclose(out);
+    }
+    if (folded_path && (out = fopen(folded_path, "w")))
+    {
+        profile_write_folded(vm, out);
+        fclose(out);
+    }
+}
+
+// SAMPLING PROFILER
+// --sample=FILE profiles by timer instead of by counting. A timer sends
+// SIGPROF to the VM thread --sample-hz times a second (default 1000), and
+// unless the guest is blocked waiting for input the handler copies the guest
+// PC and the innermost frames of a shadow call stack into a lock-free ring,
+// which a background thread drains into counts per PC, per subroutine and
+// per call stack. The engines only do extra work on calls and returns, to
+// keep the shadow stack, so the interpreter and the JIT run at full speed
+// between samples. JIT samples resolve to the start of the running block.
+// With --symbols=FILE (an lc3as .sym file) the report names addresses as
+// label+offset.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid // older glibc spells it this way
+#endif
+
+enum
+{
+    SAMPLE_RING = 4096,    // power of two
+    SAMPLE_DEPTH = 8,      // innermost frames kept per sample
+    SHADOW_DEPTH = 64,     // frames tracked, deeper calls are only counted
+    SAMPLE_STACKS = 4096,  // distinct stacks in the report, power of two
+    SAMPLE_DRAIN_MS = 20
+};
+
+struct sample
+{
+    uint16_t pc;
+    uint16_t depth;                // frames used
+    uint16_t frames[SAMPLE_DEPTH]; // subroutine entries, innermost first
+};
+
+struct sample_stack
+{
+    uint64_t count; // 0 for an empty slot
+    uint16_t depth;
+    uint16_t frames[SAMPLE_DEPTH];
+};
+
+struct sampler
+{
+    // shadow call stack, kept by the engine
+    struct
+    {
+        uint16_t entry;
+        uint16_t ret;
+    } stack[SHADOW_DEPTH];
+    int depth;
+    int overflow;                // calls beyond SHADOW_DEPTH
+    uint16_t start;              // entry of the root frame
+
+    // signal handler to drain thread
+    struct sample ring[SAMPLE_RING];
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    _Atomic uint64_t dropped;    // ring was full
+    _Atomic uint64_t waiting;    // ticks that found the VM blocked for input
+    timer_t timer;
+
+    // drain thread
+    pthread_t thread;
+    _Atomic int stop;
+    int hz;
+    double cpu_seconds;          // process CPU time at start, then the time sampled
+    uint64_t samples;
+    uint32_t pc_samples[MEMORY_MAX];
+    uint32_t self[MEMORY_MAX];   // by subroutine entry
+    uint32_t total[MEMORY_MAX];
+    struct sample_stack stacks[SAMPLE_STACKS];
+    uint64_t other_stacks;       // samples whose stack did not fit the table
+};
+
+double cpu_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct symbol
+{
+    uint16_t address;
+    char name[32];
+};
+
+const char* sample_path = NULL;
+struct symbol* symbols = NULL;
+int symbol_count = 0;
+
+int symbol_order(const void* a, const void* b)
+{
+    return ((const struct symbol*)a)->address - ((const struct symbol*)b)->address;
+}
+
+// --symbols=FILE: "LABEL ADDRESS" pairs in hex, as in the table lc3as
+// writes behind "//" comment markers; other lines are skipped
+int load_symbols(const char* path)
+{
+    FILE* in = fopen(path, "r");
+    if (!in)
+    {
+        return 0;
+    }
+    char line[256];
+    int cap = 0;
+    while (fgets(line, sizeof(line), in))
+    {
+        char* p = line;
+        while (*p == '/' || *p == ' ' || *p == '\t')
+        {
+            ++p;
+        }
+        char name[32];
+        unsigned address;
+        char rest;
+        if (sscanf(p, "%31s %x %c", name, &address, &rest) != 2 || address >= MEMORY_MAX)
+        {
+            continue;
+        }
+        if (symbol_count == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            symbols = realloc(symbols, cap * sizeof(struct symbol));
+        }
+        symbols[symbol_count].address = address;
+        strcpy(symbols[symbol_count].name, name);
+        ++symbol_count;
+    }
+    fclose(in);
+    qsort(symbols, symbol_count, sizeof(struct symbol), symbol_order);
+    return 1;
+}
+
+// "LABEL+offset" for the closest symbol at or below address, else "xADDR"
+const char* symbol_name(uint16_t address, char* buf, size_t size)
+{
+    int lo = 0;
+    int hi = symbol_count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (symbols[mid].address <= address)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    if (lo == 0)
+    {
+        snprintf(buf, size, "x%04X", address);
+    }
+    else if (symbols[lo - 1].address == address)
+    {
+        snprintf(buf, size, "%s", symbols[lo - 1].name);
+    }
+    else
+    {
+        snprintf(buf, size, "%s+%d", symbols[lo - 1].name, address - symbols[lo - 1].address);
+    }
+    return buf;
+}
+
+// called after JSR/JSRR has set the PC and R7
+void sample_call(struct vm* vm)
+{
+    struct sampler* s = vm->sampler;
+    if (s->depth == SHADOW_DEPTH)
+    {
+        ++s->overflow;
+        return;
+    }
+    s->stack[s->depth].entry = vm->reg[R_PC];
+    s->stack[s->depth].ret = vm->reg[R_R7];
+    ++s->depth; // after the frame is filled in, for the signal handler
+}
+
+// called after a JMP R7 has set the PC
+void sample_return(struct vm* vm)
+{
+    struct sampler* s = vm->sampler;
+    if (s->overflow)
+    {
+        --s->overflow;
+        return;
+    }
+    if (s->depth > 0 && s->stack[s->depth - 1].ret == vm->reg[R_PC])
+    {
+        --s->depth;
+    }
+}
+
+uint16_t jit_sample_pc(struct vm* vm, void* context);
+
+void sample_signal(int signal, siginfo_t* info, void* context)
+{
+    struct vm* vm = console_vm;
+    struct sampler* s = vm ? vm->sampler : NULL;
+    if (!s)
+    {
+        return;
+    }
+    if (vm->waiting)
+    {
+        atomic_fetch_add_explicit(&s->waiting, 1, memory_order_relaxed);
+        return;
+    }
+    uint32_t head = atomic_load_explicit(&s->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&s->tail, memory_order_acquire) == SAMPLE_RING)
+    {
+        atomic_fetch_add_explicit(&s->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    struct sample* e = &s->ring[head & (SAMPLE_RING - 1)];
+    int depth = s->depth;
+    e->pc = jit_sample_pc(vm, context);
+    e->depth = depth < SAMPLE_DEPTH ? depth : SAMPLE_DEPTH;
+    for (int k = 0; k < e->depth; ++k)
+    {
+        e->frames[k] = s->stack[depth - 1 - k].entry;
+    }
+    atomic_store_explicit(&s->head, head + 1, memory_order_release);
+}
+
+void sample_count(struct sampler* s, const struct sample* e)
+{
+    ++s->samples;
+    ++s->pc_samples[e->pc];
+    ++s->self[e->depth ? e->frames[0] : s->start];
+    ++s->total[s->start];
+    for (int k = 0; k < e->depth; ++k)
+    {
+        int seen = e->frames[k] == s->start;
+        for (int i = 0; i < k && !seen; ++i)
+        {
+            seen = e->frames[i] == e->frames[k];
+        }
+        if (!seen)
+        {
+            ++s->total[e->frames[k]]; // recursion counts once
+        }
+    }
+
+    uint64_t h = hash_bytes((const uint8_t*)e->frames, e->depth * sizeof(uint16_t)) ^ e->depth;
+    for (int probe = 0; probe < SAMPLE_STACKS; ++probe)
+    {
+        struct sample_stack* slot = &s->stacks[(h + probe) & (SAMPLE_STACKS - 1)];
+        if (!slot->count)
+        {
+            slot->depth = e->depth;
+            memcpy(slot->frames, e->frames, sizeof(slot->frames));
+        }
+        else if (slot->depth != e->depth
+                 || memcmp(slot->frames, e->frames, e->depth * sizeof(uint16_t)))
+        {
+            continue;
+        }
+        ++slot->count;
+        return;
+    }
+    ++s->other_stacks;
+}
+
+void sample_drain(struct sampler* s)
+{
+    uint32_t tail = atomic_load_explicit(&s->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&s->head, memory_order_acquire);
+    for (; tail != head; ++tail)
+    {
+        sample_count(s, &s->ring[tail & (SAMPLE_RING - 1)]);
+    }
+    atomic_store_explicit(&s->tail, tail, memory_order_release);
+}
+
+void* sample_thread(void* arg)
+{
+    struct sampler* s = arg;
+    struct timespec pause = { 0, SAMPLE_DRAIN_MS * 1000000L };
+    while (!atomic_load(&s->stop))
+    {
+        sample_drain(s);
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+// Start sampling vm, which must be console_vm and run on this thread. The
+// timer runs on the monotonic clock and signals this thread only, so the rate
+// is not capped by the scheduler tick the way CPU-time timers are.
+void sample_start(struct vm* vm, int hz)
+{
+    struct sampler* s = calloc(1, sizeof(struct sampler));
+    s->hz = hz;
+    s->start = vm->reg[R_PC];
+    s->cpu_seconds = cpu_seconds();
+    vm->sampler = s;
+    if (pthread_create(&s->thread, NULL, sample_thread, s) != 0)
+    {
+        printf("failed to start sampling thread\n");
+        exit(1);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sample_signal;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    struct sigevent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_THREAD_ID;
+    ev.sigev_signo = SIGPROF;
+    ev.sigev_notify_thread_id = gettid();
+    long ns = 1000000000L / hz; // a whole second at --sample-hz=1
+    struct timespec interval = { ns / 1000000000L, ns % 1000000000L };
+    struct itimerspec period = { interval, interval };
+    if (timer_create(CLOCK_MONOTONIC, &ev, &s->timer) != 0
+        || timer_settime(s->timer, 0, &period, NULL) != 0)
+    {
+        printf("failed to start sampling timer: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+void sample_report(struct sampler* s, FILE* out)
+{
+    char name[64];
+    uint64_t n = s->samples ? s->samples : 1;
+    fprintf(out, "samples: %llu at %d Hz in %.3f CPU seconds, %llu while waiting for input, %llu dropped\n\n",
+            (unsigned long long)s->samples, s->hz, s->cpu_seconds,
+            (unsigned long long)atomic_load(&s->waiting), (unsigned long long)atomic_load(&s->dropped));
+
+    fprintf(out, "hot PCs\naddress  symbol                      samples       %%\n");
+    for (int shown = 0; shown < PROFILE_TOP; ++shown)
+    {
+        int best = -1;
+        for (int a = 0; a < MEMORY_MAX; ++a)
+        {
+            if (s->pc_samples[a] && (best < 0 || s->pc_samples[a] > s->pc_samples[best]))
+            {
+                best = a;
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        fprintf(out, "x%04X    %-24s %10u %6.2f%%\n", best, symbol_name(best, name, sizeof(name)),
+                s->pc_samples[best], 100.0 * s->pc_samples[best] / n);
+        s->pc_samples[best] = 0;
+    }
+
+    fprintf(out, "\nsubroutines\nentry    symbol                         self    total   self%%  total%%\n");
+    for (int a = 0; a < MEMORY_MAX; ++a)
+    {
+        if (s->total[a])
+        {
+            fprintf(out, "x%04X    %-24s %10u %8u %6.2f%% %6.2f%%\n", a, symbol_name(a, name, sizeof(name)),
+                    s->self[a], s->total[a], 100.0 * s->self[a] / n, 100.0 * s->total[a] / n);
+        }
+    }
+}
+
+// one "root;caller;callee count" line per stack, for flamegraph.pl
+void sample_write_folded(struct sampler* s, FILE* out)
+{
+    char name[64];
+    for (int i = 0; i < SAMPLE_STACKS; ++i)
+    {
+        const struct sample_stack* st = &s->stacks[i];
+        if (!st->count)
+        {
+            continue;
+        }
+        fputs(symbol_name(s->start, name, sizeof(name)), out);
+        for (int k = st->depth - 1; k >= 0; --k)
+        {
+            fprintf(out, ";%s", symbol_name(st->frames[k], name, sizeof(name)));
+        }
+        fprintf(out, " %llu\n", (unsigned long long)st->count);
+    }
+    if (s->other_stacks)
+    {
+        fprintf(out, "[other] %llu\n", (unsigned long long)s->other_stacks);
+    }
+}
+
+// stop the timer and write the report to --sample, folded stacks to FILE.folded
+void sample_save(struct vm* vm)
+{
+    struct sampler* s = vm->sampler;
+    if (!s)
+    {
+        return;
+    }
+    timer_delete(s->timer);
+    s->cpu_seconds = cpu_seconds() - s->cpu_seconds;
+    atomic_store(&s->stop, 1);
+    pthread_join(s->thread, NULL);
+    sample_drain(s);
+    vm->sampler = NULL;
+
+    FILE* out;
+    if ((out = fopen(sample_path, "w")))
+    {
+        sample_report(s, out);
+        fclose(out);
+    }
+    size_t len = strlen(sample_path) + 8;
+    char* folded = malloc(len);
+    snprintf(folded, len, "%s.folded", sample_path);
+    if ((out = fopen(folded, "w")))
+    {
+        sample_write_folded(s, out);
+        fclose(out);
+    }
+    free(folded);
+    free(s);
+}
+
+// DISPATCH
+// The interpreter loop below is written once against CASE/NEXT. With GCC or
+// clang every handler ends in its own indirect jump through a table of label
+// addresses (computed goto), so the branch predictor sees one jump site per
+// opcode instead of the single shared jump of a switch. Build with
+// -DLC3_SWITCH_DISPATCH to get the portable switch loop instead.
+#if defined(__GNUC__) && !defined(LC3_SWITCH_DISPATCH)
+#define LC3_COMPUTED_GOTO 1
+#define ENGINE_NAME "computed-goto"
+#else
+#define LC3_COMPUTED_GOTO 0
+#define ENGINE_NAME "switch"
+#endif
+
+void print_stats(struct vm* vm, const char* engine, double seconds, const struct host_counters* host)
+{
+    fprintf(stderr, "engine: %s\n", engine);
+    fprintf(stderr, "instructions: %llu\n", (unsigned long long)vm->instr_count);
+    fprintf(stderr, "seconds: %.6f\n", seconds);
+    fprintf(stderr, "instructions/sec: %.0f\n", seconds > 0 ? vm->instr_count / seconds : 0.0);
+    fprintf(stderr, "idle seconds: %.6f\n", vm->idle_seconds);
+    fprintf(stderr, "idle parks: %llu\n", (unsigned long long)vm->idle_parks);
+    fprintf(stderr, "output writes: %llu\n", (unsigned long long)vm->out_writes);
+    fprintf(stderr, "output writes saved: %lld\n", (long long)(vm->out_flush_points - vm->out_writes));
+    fprintf(stderr, "syscalls: %llu\n", (unsigned long long)(vm->out_writes + atomic_load(&vm->input_reads)));
+    if (vm->intrinsics)
+    {
+        fprintf(stderr, "intrinsic calls: %llu\n", (unsigned long long)vm->native_calls);
+    }
+    if (host->error)
+    {
+        fprintf(stderr, "host counters: %s\n", strerror(host->error));
+    }
+    for (int i = 0; i < HOST_COUNTERS; ++i)
+    {
+        if (host->fd[i] < 0)
+        {
+            fprintf(stderr, "host %s: unavailable\n", host_events[i].name);
+            continue;
+        }
+        fprintf(stderr, "host %s: %llu\n", host_events[i].name, (unsigned long long)host->value[i]);
+        if (i != HOST_CYCLES && vm->instr_count)
+        {
+            fprintf(stderr, "host %s/instruction: %.3f\n", host_events[i].name,
+                    (double)host->value[i] / vm->instr_count);
+        }
+    }
+    if (host->fd[HOST_CYCLES] >= 0 && host->fd[HOST_INSTRUCTIONS] >= 0 && host->value[HOST_CYCLES])
+    {
+        fprintf(stderr, "host IPC: %.3f\n", (double)host->value[HOST_INSTRUCTIONS] / host->value[HOST_CYCLES]);
+    }
+}
+
+void run(struct vm* vm)
+{
+    uint16_t* reg = vm->reg;
+    uint64_t* pc_hits = vm->profile ? vm->profile->pc_hits : NULL;
+    struct counters* counters = vm->counters;
+    int interrupts = vm->interrupts; // only stores, RTI and exceptions change it
+    const struct decoded* d;
+
+// retire the second word of a superinstruction as if it had been fetched
+#define FUSED_SECOND(op)                               \
+    do {                                               \
+        if (pc_hits) ++pc_hits[reg[R_PC]];             \
+        ++reg[R_PC];                                   \
+        ++vm->instr_count;                             \
+        if (counters) ++counters->opcodes[op];         \
+    } while (0)
+
+// the BR decoded in the second word
+#define FUSED_BR                                       \
+    do {                                               \
+        if (d[1].r0 & COND_FLAGS(reg[R_COND])) {       \
+            reg[R_PC] = d[1].imm;                      \
+            if (counters) ++counters->branches_taken;  \
+            if (interrupts) goto interrupt;        \
+        }                                              \
+        else if (counters) {                           \
+            ++counters->branches_not_taken;            \
+        }                                              \
+    } while (0)
+
+#if LC3_COMPUTED_GOTO
+    static const void* dispatch_table[OP_HANDLERS] = {
+        &&do_OP_BR, &&do_OP_ADD, &&do_OP_LD, &&do_OP_ST,
+        &&do_OP_JSR, &&do_OP_AND, &&do_OP_LDR, &&do_OP_STR,
+        &&do_OP_RTI, &&do_OP_NOT, &&do_OP_LDI, &&do_OP_STI,
+        &&do_OP_JMP, &&do_OP_RES, &&do_OP_LEA, &&do_OP_TRAP,
+        &&do_OP_ADDI, &&do_OP_ANDI, &&do_OP_JSRR, &&do_OP_NATIVE, &&do_OP_DECODE,
+        &&do_OP_ADD_BR, &&do_OP_ADDI_BR, &&do_OP_LDI_BR, &&do_OP_CLR_ADDI
+    };
+#define CASE(op) do_##op
+#define NEXT                                                      \
+    do {                                                          \
+        if (pc_hits) ++pc_hits[reg[R_PC]];                        \
+        d = &vm->code->decoded[reg[R_PC]++];                      \
+        ++vm->instr_count;                                        \
+        if (counters) ++counters->opcodes[handler_opcode[d->op]]; \
+        goto *dispatch_table[d->op];                              \
+    } while (0)
+
+    NEXT;
+#else
+#define CASE(op) case op
+#define NEXT break
+
+    for (;;) {
+        // FETCH DECODED INSTR
+        if (pc_hits) ++pc_hits[reg[R_PC]];
+        d = &vm->code->decoded[reg[R_PC]++];
+        ++vm->instr_count;
+        if (counters) ++counters->opcodes[handler_opcode[d->op]];
+
+        switch (d->op)
+        {
+#endif
+            CASE(OP_ADD):
+                {
+                    reg[d->r0] = reg[d->r1] + reg[d->r2];
+                    update_flags(vm, d->r0);
+                    NEXT;
+                }
+            CASE(OP_ADDI):
+                {
+                    reg[d->r0] = reg[d->r1] + d->imm;
+                    update_flags(vm, d->r0);
+                    NEXT;
+                }
+            CASE(OP_AND):
+                {
+                    reg[d->r0] = reg[d->r1] & reg[d->r2];
+                    update_flags(vm, d->r0);
+                    NEXT;
+                }
+            CASE(OP_ANDI):
+                {
+                    reg[d->r0] = reg[d->r1] & d->imm;
+                    update_flags(vm, d->r0);
+                    NEXT;
+                }
+            CASE(OP_NOT):
+                {
+                    reg[d->r0] = ~reg[d->r1];
+                    update_flags(vm, d->r0);
+                    NEXT;
+                }
+            CASE(OP_BR):
+                {
+                    if (d->r0 & COND_FLAGS(reg[R_COND])) { // n,z,p
+                        reg[R_PC] = d->imm;
+                        if (counters) ++counters->branches_taken;
+                        if (interrupts) goto interrupt;
+                    }
+                    else if (counters) {
+                        ++counters->branches_not_taken;
+                    }
+                    NEXT;
+                }
+            CASE(OP_JMP):
+                {
+                    // also handles RET
+                    reg[R_PC] = reg[d->r1];
+                    if (pc_hits && d->r1 == R_R7) profile_return(vm);
+                    if (vm->sampler && d->r1 == R_R7) sample_return(vm);
+                    if (interrupts) goto interrupt;
+                    NEXT;
+                }
+            CASE(OP_JSR):
+                {
+                    reg[R_R7] = reg[R_PC];
+                    reg[R_PC] = d->imm;
+                    if (pc_hits) profile_call(vm);
+                    if (vm->sampler) sample_call(vm);
+                    if (interrupts) goto interrupt;
+                    NEXT;
+                }
+            CASE(OP_NATIVE):
+                {
+                    reg[R_R7] = reg[R_PC];
+                    reg[R_PC] = d->imm;
+                    if (!native_call(vm, d->r2))
+                    {
+                        if (pc_hits) profile_call(vm);
+                        if (vm->sampler) sample_call(vm);
+                    }
+                    if (interrupts) goto interrupt;
+                    NEXT;
+                }
+            CASE(OP_JSRR):
+                {
+                    uint16_t target = reg[d->r1];
+                    reg[R_R7] = reg[R_PC];
+                    reg[R_PC] = target;
+                    if (pc_hits) profile_call(vm);
+                    if (vm->sampler) sample_call(vm);
+                    if (interrupts) goto interrupt;
+                    NEXT;
+                }
+            CASE(OP_LD):
+                {
+                    reg[d->r0] = mem_read(vm, d->imm);
+                    update_flags(vm, d->r0);
+                    NEXT;
+                }
+            CASE(OP_LDI):
+                {
+                    // look at the memory location the offset points to to get the final address
+                    reg[d->r0] = mem_read(vm, mem_read(vm, d->imm));
+                    update_flags(vm, d->r0);
+                    NEXT;
+                }
+            CASE(OP_LDR):
+                {
+                    reg[d->r0] = mem_read(vm, reg[d->r1] + d->imm);
+                    update_flags(vm, d->r0);
+                    NEXT;
+                }
+            CASE(OP_LEA):
+                {
+                    reg[d->r0] = d->imm;
+                    update_flags(vm, d->r0);
+                    NEXT;
+                }
+            CASE(OP_ST):
+                {
+                    mem_write(vm, d->imm, reg[d->r0]);
+                    if (vm->halted) {
+                        goto halt; // the store cleared MCR bit 15
+                    }
+                    interrupts = vm->interrupts;
+                    NEXT;
+                }
+            CASE(OP_STI):
+                {
+                    mem_write(vm, mem_read(vm, d->imm), reg[d->r0]);
+                    if (vm->halted) {
+                        goto halt; // the store cleared MCR bit 15
+                    }
+                    interrupts = vm->interrupts;
+                    NEXT;
+                }
+            CASE(OP_STR):
+                {
+                    mem_write(vm, reg[d->r1] + d->imm, reg[d->r0]);
+                    if (vm->halted) {
+                        goto halt; // the store cleared MCR bit 15
+                    }
+                    interrupts = vm->interrupts;
+                    NEXT;
+                }
+            CASE(OP_ADD_BR):
+                {
+                    reg[d->r0] = reg[d->r1] + reg[d->r2];
+                    update_flags(vm, d->r0);
+                    FUSED_SECOND(OP_BR);
+                    FUSED_BR;
+                    NEXT;
+                }
+            CASE(OP_ADDI_BR):
+                {
+                    reg[d->r0] = reg[d->r1] + d->imm;
+                    update_flags(vm, d->r0);
+                    FUSED_SECOND(OP_BR);
+                    FUSED_BR;
+                    NEXT;
+                }
+            CASE(OP_LDI_BR):
+                {
+                    // the second word only counts as retired after the read,
+                    // which record and replay rely on for KBSR polls
+                    reg[d->r0] = mem_read(vm, mem_read(vm, d->imm));
+                    update_flags(vm, d->r0);
+                    FUSED_SECOND(OP_BR);
+                    FUSED_BR;
+                    NEXT;
+                }
+            CASE(OP_CLR_ADDI):
+                {
+                    reg[d->r0] = d[1].imm;
+                    update_flags(vm, d->r0);
+                    FUSED_SECOND(OP_ADD);
+                    NEXT;
+                }
+            CASE(OP_DECODE):
+                {
+                    // decode the word in place and run it again as a normal fetch
+                    decode(vm, --reg[R_PC]);
+                    --vm->instr_count;
+                    if (pc_hits) --pc_hits[reg[R_PC]];
+                    NEXT;
+                }
+            CASE(OP_TRAP):
+                {
+                    reg[R_R7] = reg[R_PC];
+
+                    if (!execute_trap(vm, d->imm)) {
+                        goto halt;
+                    }
+                    if (interrupts) goto interrupt;
+                    NEXT;
+                }
+            interrupt:
+                {
+                    // a taken control transfer while an interrupt could be pending
+                    interrupt_check(vm);
+                    interrupts = vm->interrupts;
+                    NEXT;
+                }
+            CASE(OP_RTI):
+                {
+                    if (!execute_rti(vm)) {
+                        goto halt;
+                    }
+                    interrupts = vm->interrupts;
+                    NEXT;
+                }
+            CASE(OP_RES):
+#if !LC3_COMPUTED_GOTO
+            default:
+#endif
+                {
+                    if (!execute_exception(vm, EXC_ILLEGAL)) {
+                        goto halt;
                     }
+                    interrupts = vm->interrupts;
+                    NEXT;
+                }
+#if !LC3_COMPUTED_GOTO
+        }
+    }
+#endif
+
+halt:
+    return;
+#undef CASE
+#undef NEXT
+#undef FUSED_SECOND
+#undef FUSED_BR
+}
+
+// JIT
+// x86-64 only. LC-3 basic blocks (ending at BR/JMP/JSR/TRAP) are translated to
+// native code in an mmap'd buffer and cached by start PC, one JIT per machine.
+// Generated code keeps the vm in rbx (registers are at the start of struct vm),
+// memory in r12, &instr_count in r13, the slice deadline in r14 and the
+// code[] map in r15. Direct exits are chained straight to their target block
+// the first time they are taken. TRAPs and loads and stores on device pages
+// call back into the C helpers, and a store that lands on compiled code
+// flushes the whole cache.
+#if defined(__x86_64__) && !defined(LC3_NO_JIT)
+#define LC3_JIT 1
+#else
+#define LC3_JIT 0
+#endif
+
+#if LC3_JIT
+enum
+{
+    JIT_BUFFER_SIZE = 8 << 20,
+    JIT_MAX_BLOCK = 64,        // guest instructions per block
+    JIT_BLOCK_BYTES = 64 << 7, // upper bound on native code per block
+    JIT_SLICE = 1 << 20        // instructions between returns to the dispatcher
+};
+
+struct jit
+{
+    uint8_t* buffer;
+    uint8_t* epilogue;
+    uint8_t* code_start;         // first byte after the entry/exit stubs
+    uint8_t* end;                // emit cursor
+    unsigned generation;         // bumped on every flush
+    int running;
+    uint8_t* blocks[MEMORY_MAX]; // native entry point per start PC
+    uint8_t code[MEMORY_MAX];    // word is covered by a compiled block
+    struct
+    {
+        uint8_t* start;
+        uint16_t pc;
+    } placed[MEMORY_MAX];        // blocks in buffer order, for the sampler
+    _Atomic int placed_count;
+};
+
+typedef uint8_t* (*jit_entry_fn)(struct vm* vm, uint16_t* memory, uint64_t* count,
+                                 uint64_t deadline, uint8_t* block, uint8_t* code);
+
+#define EMIT(j, ...) emit_bytes(j, (const uint8_t[]){ __VA_ARGS__ }, sizeof((const uint8_t[]){ __VA_ARGS__ }))
+#define REG_DISP(r) (offsetof(struct vm, reg) + (r) * 2)
+
+enum { X_EAX = 0, X_ECX = 1, X_EDX = 2 };
+
+void emit_bytes(struct jit* j, const uint8_t* bytes, size_t n)
+{
+    memcpy(j->end, bytes, n);
+    j->end += n;
+}
+
+void emit16(struct jit* j, uint16_t v) { memcpy(j->end, &v, 2); j->end += 2; }
+void emit32(struct jit* j, uint32_t v) { memcpy(j->end, &v, 4); j->end += 4; }
+void emit64(struct jit* j, uint64_t v) { memcpy(j->end, &v, 8); j->end += 8; }
+
+void patch_rel32(uint8_t* at, uint8_t* target)
+{
+    int32_t rel = (int32_t)(target - (at + 4));
+    memcpy(at, &rel, 4);
+}
+
+void patch_rel8(struct jit* j, uint8_t* at)
+{
+    *at = (uint8_t)(j->end - (at + 1));
+}
+
+void emit_load_reg(struct jit* j, int x, int r)  { EMIT(j, 0x0F, 0xB7, 0x43 | x << 3, REG_DISP(r)); } // movzx x, word [rbx+r]
+void emit_store_reg(struct jit* j, int x, int r) { EMIT(j, 0x66, 0x89, 0x43 | x << 3, REG_DISP(r)); } // mov [rbx+r], x16
+
+void emit_store_imm(struct jit* j, int r, uint16_t v)
+{
+    EMIT(j, 0x66, 0xC7, 0x43, REG_DISP(r)); // mov word [rbx+r], imm16
+    emit16(j, v);
+}
+
+// call fn(vm, ...): the remaining arguments are already in esi/edx
+void emit_call(struct jit* j, void* fn)
+{
+    EMIT(j, 0x48, 0x89, 0xDF); // mov rdi, rbx
+    EMIT(j, 0x48, 0xB8);       // mov rax, imm64
+    emit64(j, (uint64_t)(uintptr_t)fn);
+    EMIT(j, 0xFF, 0xD0);       // call rax
+}
+
+void emit_exit(struct jit* j)
+{
+    EMIT(j, 0x31, 0xC0, 0xE9); // xor eax, eax; jmp epilogue
+    j->end += 4;
+    patch_rel32(j->end - 4, j->epilogue);
+}
+
+// the result is in ax: set R_COND the way update_flags() does
+#ifndef LC3_EAGER_FLAGS
+void emit_flags(struct jit* j)
+{
+    EMIT(j, 0x66, 0x89, 0x43, REG_DISP(R_COND)); // mov [rbx+cond], ax
+}
+
+// jump to the returned rel32 slot unless BR with mask nzp is taken: every
+// mask is one signed condition on the last flag-setting value
+uint8_t* emit_branch_not_taken(struct jit* j, int nzp)
+{
+    static const uint8_t jcc[8] = {
+        [FL_NEG] = 0x89,                   // jns
+        [FL_ZRO] = 0x85,                   // jnz
+        [FL_POS] = 0x8E,                   // jle
+        [FL_NEG | FL_ZRO] = 0x8F,          // jg
+        [FL_NEG | FL_POS] = 0x84,          // jz
+        [FL_ZRO | FL_POS] = 0x88,          // js
+    };
+    EMIT(j, 0x66, 0x83, 0x7B, REG_DISP(R_COND), 0x00, // cmp word [rbx+cond], 0
+            0x0F, jcc[nzp], 0, 0, 0, 0);
+    return j->end - 4;
+}
+#else
+void emit_flags(struct jit* j)
+{
+    EMIT(j, 0xB9, FL_POS, 0, 0, 0,  // mov ecx, FL_POS
+            0xBA, FL_ZRO, 0, 0, 0,  // mov edx, FL_ZRO
+            0x66, 0x85, 0xC0,       // test ax, ax
+            0x0F, 0x44, 0xCA,       // cmovz ecx, edx
+            0xBA, FL_NEG, 0, 0, 0,  // mov edx, FL_NEG
+            0x0F, 0x48, 0xCA,       // cmovs ecx, edx
+            0x66, 0x89, 0x4B, REG_DISP(R_COND));
+}
+
+uint8_t* emit_branch_not_taken(struct jit* j, int nzp)
+{
+    EMIT(j, 0xF6, 0x43, REG_DISP(R_COND), nzp, // test byte [rbx+cond], nzp
+            0x0F, 0x84, 0, 0, 0, 0);          // jz not_taken
+    return j->end - 4;
+}
+#endif
+
+void jit_flush(struct jit* j)
+{
+    atomic_store(&j->placed_count, 0);
+    memset(j->blocks, 0, sizeof(j->blocks));
+    memset(j->code, 0, sizeof(j->code));
+    j->end = j->code_start;
+    ++j->generation;
+}
+
+int jit_compiled(struct jit* j, uint16_t address)
+{
+    return j->code[address];
+}
+
+// remaining: instructions of the block after this one, already counted
+uint16_t jit_read(struct vm* vm, uint16_t address, int remaining)
+{
+    vm->instr_pending = remaining;
+    uint16_t val = mem_read(vm, address);
+    vm->instr_pending = 0;
+    return val;
+}
+
+int jit_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    int hit = vm->jit->code[address];
+    mem_write(vm, address, val);
+    if (hit)
+    {
+        // the running block may be the one that was overwritten, it exits right after this
+        jit_flush(vm->jit);
+    }
+    if (vm->halted)
+    {
+        vm->jit->running = 0;
+        return 1;
+    }
+    return hit;
+}
+
+int jit_trap(struct vm* vm, uint16_t vector)
+{
+    if (!execute_trap(vm, vector))
+    {
+        vm->jit->running = 0;
+        return 0;
+    }
+    return 1;
+}
+
+// jne rel8 when the page of the address in eax has devices; clobbers edx
+void emit_io_check(struct jit* j, uint8_t skip)
+{
+    EMIT(j, 0x89, 0xC2, 0xC1, 0xEA, PAGE_SHIFT); // mov edx, eax; shr edx, PAGE_SHIFT
+    EMIT(j, 0x48, 0x83, 0xBC, 0xD3);             // cmp qword [rbx + rdx*8 + io], 0
+    emit32(j, offsetof(struct vm, io));
+    EMIT(j, 0);
+    EMIT(j, 0x75, skip);                         // jne slow
+}
+
+// eax = address, result in eax; only pages with devices go through mem_read(),
+// with reg[R_PC] and the retired instruction count brought up to date first
+void emit_read(struct jit* j, uint16_t next, int remaining)
+{
+    emit_io_check(j, 0x07);
+    EMIT(j, 0x41, 0x0F, 0xB7, 0x04, 0x44); // movzx eax, word [r12 + rax*2]
+    EMIT(j, 0xEB, 0);                      // jmp done
+    uint8_t* done = j->end - 1;
+    EMIT(j, 0x89, 0xC6);                   // slow: mov esi, eax
+    EMIT(j, 0xBA); emit32(j, remaining);   // mov edx, remaining
+    emit_store_imm(j, R_PC, next);
+    emit_call(j, jit_read);
+    EMIT(j, 0x0F, 0xB7, 0xC0);             // movzx eax, ax
+    patch_rel8(j, done);
+}
+
+void emit_read_const(struct jit* j, struct vm* vm, uint16_t address, uint16_t next, int remaining)
+{
+    if (vm->io[address >> PAGE_SHIFT])
+    {
+        EMIT(j, 0xBE); emit32(j, address);    // mov esi, address
+        EMIT(j, 0xBA); emit32(j, remaining);  // mov edx, remaining
+        emit_store_imm(j, R_PC, next);
+        emit_call(j, jit_read);
+        EMIT(j, 0x0F, 0xB7, 0xC0);            // movzx eax, ax
+    }
+    else
+    {
+        EMIT(j, 0x41, 0x0F, 0xB7, 0x84, 0x24); // movzx eax, word [r12 + disp32]
+        emit32(j, address * 2);
+    }
+}
+
+// eax = address, ecx = value. Stores to words that are neither compiled nor
+// on a device page go straight to memory; the rest go through jit_write()
+// and, when that flushed the cache or stopped the machine, leave the block
+// with PC at the next instruction.
+void emit_write(struct jit* j, uint16_t next, int remaining)
+{
+    EMIT(j, 0x89, 0xC2, 0xC1, 0xEA, PAGE_SHIFT, // mov edx, eax; shr edx, PAGE_SHIFT
+            0xC6, 0x84, 0x13);                // mov byte [rbx + rdx + dirty], 1
+    emit32(j, offsetof(struct vm, dirty));
+    EMIT(j, 1);
+    emit_io_check(j, 0x0E);                   // over the code check to slow
+    EMIT(j, 0x41, 0x80, 0x3C, 0x07, 0x00);    // cmp byte [r15 + rax], 0
+    EMIT(j, 0x75, 0x07);                      // jne slow
+    EMIT(j, 0x66, 0x41, 0x89, 0x0C, 0x44);    // mov [r12 + rax*2], cx
+    EMIT(j, 0xEB, 0);                         // jmp done
+    uint8_t* done = j->end - 1;
+    EMIT(j, 0x89, 0xC6, 0x89, 0xCA);          // slow: mov esi, eax; mov edx, ecx
+    emit_call(j, jit_write);
+    EMIT(j, 0x85, 0xC0, 0x74, 0);             // test eax, eax; jz done
+    uint8_t* kept = j->end - 1;
+    if (remaining)
+    {
+        EMIT(j, 0x49, 0x83, 0x6D, 0x00, remaining); // sub qword [r13], remaining
+    }
+    emit_store_imm(j, R_PC, next);
+    emit_exit(j);
+    patch_rel8(j, done);
+    patch_rel8(j, kept);
+}
+
+// leave for a known PC; the leading jmp is patched to enter the target
+// block directly once it has been compiled
+void emit_chain_exit(struct jit* j, uint16_t target)
+{
+    uint8_t* site = j->end;
+    EMIT(j, 0xE9, 0, 0, 0, 0);
+    emit_store_imm(j, R_PC, target);
+    EMIT(j, 0x48, 0xB8);               // mov rax, site
+    emit64(j, (uint64_t)(uintptr_t)site);
+    EMIT(j, 0xE9);                     // jmp epilogue
+    j->end += 4;
+    patch_rel32(j->end - 4, j->epilogue);
+}
+
+// add k to a 64-bit counter; clobbers rax
+void emit_count(struct jit* j, uint64_t* counter, int k)
+{
+    EMIT(j, 0x48, 0xB8);               // mov rax, counter
+    emit64(j, (uint64_t)(uintptr_t)counter);
+    EMIT(j, 0x48, 0x83, 0x00, k);      // add qword [rax], k
+}
+
+// eax = new PC, already stored in reg[R_PC]
+void emit_indirect_exit(struct jit* j)
+{
+    EMIT(j, 0x48, 0xB9);               // mov rcx, blocks
+    emit64(j, (uint64_t)(uintptr_t)j->blocks);
+    EMIT(j, 0x48, 0x8B, 0x0C, 0xC1,    // mov rcx, [rcx + rax*8]
+            0x48, 0x85, 0xC9,          // test rcx, rcx
+            0x74, 0x02,                // jz +2
+            0xFF, 0xE1);               // jmp rcx
+    emit_exit(j);
+}
+
+// at a taken control transfer to target, or with reg[R_PC] and eax already
+// holding the new PC when target is -1: while vm->interrupts is set, run
+// interrupt_check() and leave for whatever PC it left
+void emit_interrupt_check(struct jit* j, int target)
+{
+    EMIT(j, 0x83, 0xBB);               // cmp dword [rbx + interrupts], 0
+    emit32(j, offsetof(struct vm, interrupts));
+    EMIT(j, 0x00, 0x74, 0);            // je done
+    uint8_t* done = j->end - 1;
+    if (target >= 0)
+    {
+        emit_store_imm(j, R_PC, target);
+    }
+    emit_call(j, interrupt_check);
+    emit_load_reg(j, X_EAX, R_PC);
+    emit_indirect_exit(j);
+    patch_rel8(j, done);
+}
+
+struct jit* jit_create()
+{
+    struct jit* j = calloc(1, sizeof(struct jit));
+    j->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->buffer == MAP_FAILED)
+    {
+        printf("failed to map JIT buffer\n");
+        exit(1);
+    }
+    j->end = j->buffer;
+
+    // entry: jit_entry_fn
+    EMIT(j, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, // push rbx, r12-r15
+            0x48, 0x89, 0xFB,          // mov rbx, rdi
+            0x49, 0x89, 0xF4,          // mov r12, rsi
+            0x49, 0x89, 0xD5,          // mov r13, rdx
+            0x49, 0x89, 0xCE,          // mov r14, rcx
+            0x4D, 0x89, 0xCF,          // mov r15, r9
+            0x41, 0xFF, 0xE0);         // jmp r8
+
+    j->epilogue = j->end;
+    EMIT(j, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3);
+
+    j->code_start = j->end;
+    return j;
+}
+
+void jit_destroy(struct jit* j)
+{
+    munmap(j->buffer, JIT_BUFFER_SIZE);
+    free(j);
+}
+
+// RTI and the reserved opcode are not compiled: the dispatcher retires them
+// here, returns 0 when the machine stopped
+int jit_privileged(struct vm* vm)
+{
+    uint16_t op = vm->memory[vm->reg[R_PC]++] >> 12;
+    ++vm->instr_count;
+    if (vm->counters)
+    {
+        ++vm->counters->opcodes[op];
+    }
+    return op == OP_RTI ? execute_rti(vm) : execute_exception(vm, EXC_ILLEGAL);
+}
+
+// returns NULL when the block would start with RTI or the reserved opcode
+uint8_t* jit_compile(struct vm* vm, uint16_t start)
+{
+    struct jit* j = vm->jit;
+    if (j->end + JIT_BLOCK_BYTES > j->buffer + JIT_BUFFER_SIZE)
+    {
+        jit_flush(j);
+    }
+
+    // find the block: always decode afresh, stores from JIT code skip the decoded cache
+    struct decoded block[JIT_MAX_BLOCK];
+    int n = 0;
+    int ends = 0;
+    while (n < JIT_MAX_BLOCK && !ends)
+    {
+        uint16_t pc = start + n;
+        decode_word(&block[n], vm->memory[pc], pc);
+        switch (block[n].op)
+        {
+            case OP_RTI:
+            case OP_RES:
+                ends = -1;
+                break;
+            case OP_BR:
+                ends = block[n].r0 != 0; // BR with no n/z/p bits is a no-op
+                ++n;
+                break;
+            case OP_JMP:
+            case OP_JSR:
+            case OP_JSRR:
+            case OP_TRAP:
+                ends = 1;
+                ++n;
+                break;
+            default:
+                ++n;
+                break;
+        }
+    }
+    if (n == 0)
+    {
+        return NULL;
+    }
+
+    uint8_t* entry = j->end;
+
+    // check the slice deadline, then retire the whole block up front
+    EMIT(j, 0x49, 0x8B, 0x45, 0x00,    // mov rax, [r13]
+            0x4C, 0x39, 0xF0,          // cmp rax, r14
+            0x0F, 0x83, 0, 0, 0, 0);   // jae bail
+    uint8_t* bail = j->end - 4;
+    EMIT(j, 0x48, 0x83, 0xC0, n,       // add rax, n
+            0x49, 0x89, 0x45, 0x00);   // mov [r13], rax
+
+    struct counters* counters = vm->counters;
+    if (counters)
+    {
+        // opcodes are counted per block too, a block left early by a store to code over-counts
+        int per_op[16] = { 0 };
+        for (int i = 0; i < n; ++i)
+        {
+            ++per_op[handler_opcode[block[i].op]];
+        }
+        for (int op = 0; op < 16; ++op)
+        {
+            if (per_op[op])
+            {
+                emit_count(j, &counters->opcodes[op], per_op[op]);
+            }
+        }
+    }
+
+    // condition codes only need storing when something can see them before
+    // the next instruction that sets them: a branch, a trap, a block exit or
+    // a load that may read PSR, i.e. any load not known to hit plain memory
+    int flags_live[JIT_MAX_BLOCK];
+    int live = 1;
+    for (int i = n - 1; i >= 0; --i)
+    {
+        flags_live[i] = live;
+        switch (block[i].op)
+        {
+            case OP_ADD: case OP_ADDI: case OP_AND: case OP_ANDI: case OP_NOT:
+            case OP_LEA:
+                live = 0;
+                break;
+            case OP_LD:
+                live = vm->io[block[i].imm >> PAGE_SHIFT] != NULL;
+                break;
+            default:
+                live = 1; // BR, JMP, JSR, TRAP, stores, LDI and LDR
+                break;
+        }
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+        uint16_t pc = start + i;
+        uint16_t next = pc + 1;
+        const struct decoded* d = &block[i];
+        int native;
+        j->code[pc] = 1;
+
+        switch (d->op)
+        {
+            case OP_ADD:
+            case OP_AND:
+                emit_load_reg(j, X_EAX, d->r1);
+                emit_load_reg(j, X_ECX, d->r2);
+                EMIT(j, d->op == OP_ADD ? 0x01 : 0x21, 0xC8); // add/and eax, ecx
+                emit_store_reg(j, X_EAX, d->r0);
+                if (flags_live[i]) emit_flags(j);
+                break;
+            case OP_ADDI:
+            case OP_ANDI:
+                emit_load_reg(j, X_EAX, d->r1);
+                EMIT(j, d->op == OP_ADDI ? 0x05 : 0x25); // add/and eax, imm32
+                emit32(j, d->imm);
+                emit_store_reg(j, X_EAX, d->r0);
+                if (flags_live[i]) emit_flags(j);
+                break;
+            case OP_NOT:
+                emit_load_reg(j, X_EAX, d->r1);
+                EMIT(j, 0xF7, 0xD0);         // not eax
+                emit_store_reg(j, X_EAX, d->r0);
+                if (flags_live[i]) emit_flags(j);
+                break;
+            case OP_LEA:
+                EMIT(j, 0xB8); emit32(j, d->imm); // mov eax, imm32
+                emit_store_reg(j, X_EAX, d->r0);
+                if (flags_live[i]) emit_flags(j);
+                break;
+            case OP_LD:
+                emit_read_const(j, vm, d->imm, next, n - i - 1);
+                emit_store_reg(j, X_EAX, d->r0);
+                if (flags_live[i]) emit_flags(j);
+                break;
+            case OP_LDI:
+                emit_read_const(j, vm, d->imm, next, n - i - 1);
+                emit_read(j, next, n - i - 1);
+                emit_store_reg(j, X_EAX, d->r0);
+                if (flags_live[i]) emit_flags(j);
+                break;
+            case OP_LDR:
+                emit_load_reg(j, X_EAX, d->r1);
+                EMIT(j, 0x05); emit32(j, d->imm);
+                EMIT(j, 0x0F, 0xB7, 0xC0);   // movzx eax, ax
+                emit_read(j, next, n - i - 1);
+                emit_store_reg(j, X_EAX, d->r0);
+                if (flags_live[i]) emit_flags(j);
+                break;
+            case OP_ST:
+                EMIT(j, 0xB8); emit32(j, d->imm);
+                emit_load_reg(j, X_ECX, d->r0);
+                emit_write(j, next, n - i - 1);
+                break;
+            case OP_STI:
+                emit_read_const(j, vm, d->imm, next, n - i - 1);
+                emit_load_reg(j, X_ECX, d->r0);
+                emit_write(j, next, n - i - 1);
+                break;
+            case OP_STR:
+                emit_load_reg(j, X_EAX, d->r1);
+                EMIT(j, 0x05); emit32(j, d->imm);
+                EMIT(j, 0x0F, 0xB7, 0xC0);
+                emit_load_reg(j, X_ECX, d->r0);
+                emit_write(j, next, n - i - 1);
+                break;
+            case OP_BR:
+                if (d->r0 == 0)
+                {
+                    if (counters) emit_count(j, &counters->branches_not_taken, 1);
+                    break;
+                }
+                if (d->r0 != (FL_NEG | FL_ZRO | FL_POS))
+                {
+                    uint8_t* not_taken = emit_branch_not_taken(j, d->r0);
+                    if (counters) emit_count(j, &counters->branches_taken, 1);
+                    emit_interrupt_check(j, d->imm);
+                    emit_chain_exit(j, d->imm);
+                    patch_rel32(not_taken, j->end);
+                    if (counters) emit_count(j, &counters->branches_not_taken, 1);
+                    emit_chain_exit(j, next);
+                    break;
+                }
+                if (counters) emit_count(j, &counters->branches_taken, 1);
+                emit_interrupt_check(j, d->imm);
+                emit_chain_exit(j, d->imm);
+                break;
+            case OP_JMP:
+                emit_load_reg(j, X_EAX, d->r1);
+                emit_store_reg(j, X_EAX, R_PC);
+                if (vm->sampler && d->r1 == R_R7)
+                {
+                    emit_call(j, sample_return);
+                    emit_load_reg(j, X_EAX, R_PC);
+                }
+                emit_interrupt_check(j, -1);
+                emit_indirect_exit(j);
+                break;
+            case OP_JSR:
+                if (vm->intrinsics && !vm->sampler && !vm->counters && (native = native_find(vm, d->imm)) >= 0)
+                {
+                    // native_call() returns from the routine, or leaves PC at its entry
+                    emit_store_imm(j, R_R7, next);
+                    emit_store_imm(j, R_PC, d->imm);
+                    EMIT(j, 0xBE); emit32(j, native); // mov esi, index
+                    emit_call(j, native_call);
+                    emit_load_reg(j, X_EAX, R_PC);
+                    emit_interrupt_check(j, -1);
+                    emit_indirect_exit(j);
+                    break;
+                }
+                emit_store_imm(j, R_R7, next);
+                if (vm->sampler)
+                {
+                    emit_store_imm(j, R_PC, d->imm);
+                    emit_call(j, sample_call);
+                }
+                emit_interrupt_check(j, d->imm);
+                emit_chain_exit(j, d->imm);
+                break;
+            case OP_JSRR:
+                emit_store_imm(j, R_R7, next);
+                emit_load_reg(j, X_EAX, d->r1);
+                emit_store_reg(j, X_EAX, R_PC);
+                if (vm->sampler)
+                {
+                    emit_call(j, sample_call);
+                    emit_load_reg(j, X_EAX, R_PC);
+                }
+                emit_interrupt_check(j, -1);
+                emit_indirect_exit(j);
+                break;
+            case OP_TRAP:
+                emit_store_imm(j, R_R7, next);
+                emit_store_imm(j, R_PC, next);
+                EMIT(j, 0xBE); emit32(j, d->imm); // mov esi, vector
+                emit_call(j, jit_trap);
+                EMIT(j, 0x85, 0xC0, 0x75, 0x07); // test eax, eax; jnz chain
+                emit_exit(j);
+                emit_interrupt_check(j, next);
+                emit_chain_exit(j, next);
+                break;
+        }
+    }
+    if (ends <= 0)
+    {
+        // ran into the length limit, RTI or the reserved opcode
+        emit_chain_exit(j, start + n);
+    }
+
+    patch_rel32(bail, j->end);
+    emit_store_imm(j, R_PC, start);
+    emit_exit(j);
+
+    j->blocks[start] = entry;
+    int k = atomic_load(&j->placed_count);
+    j->placed[k].start = entry;
+    j->placed[k].pc = start;
+    atomic_store(&j->placed_count, k + 1);
+    return entry;
+}
+
+// guest PC for a SIGPROF taken at context: the start of the block the host
+// is running, else one before reg[R_PC] as in the interpreter
+uint16_t jit_sample_pc(struct vm* vm, void* context)
+{
+    struct jit* j = vm->jit;
+    const uint8_t* rip = (const uint8_t*)((ucontext_t*)context)->uc_mcontext.gregs[REG_RIP];
+    if (j && rip >= j->code_start && rip < j->end)
+    {
+        int lo = 0;
+        int hi = atomic_load(&j->placed_count);
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (j->placed[mid].start <= rip)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        if (lo > 0)
+        {
+            return j->placed[lo - 1].pc;
+        }
+    }
+    return vm->reg[R_PC] - 1;
+}
+
+void run_jit(struct vm* vm)
+{
+    if (!vm->jit)
+    {
+        vm->jit = jit_create();
+    }
+    struct jit* j = vm->jit;
+    jit_entry_fn enter = (jit_entry_fn)(void*)j->buffer;
+    uint8_t* site = NULL;
+    unsigned generation = j->generation;
+
+    j->running = 1;
+    while (j->running)
+    {
+        uint8_t* block = j->blocks[vm->reg[R_PC]];
+        if (!block)
+        {
+            block = jit_compile(vm, vm->reg[R_PC]);
+            if (!block)
+            {
+                j->running = jit_privileged(vm);
+                site = NULL;
+                continue;
+            }
+        }
+        if (site && generation == j->generation)
+        {
+            patch_rel32(site + 1, block); // chain the exit we just left through
+        }
+        generation = j->generation;
+        site = enter(vm, vm->memory, &vm->instr_count, vm->instr_count + JIT_SLICE, block, j->code);
+    }
+}
+#else
+void jit_destroy(struct jit* jit)
+{
+}
+
+int jit_compiled(struct jit* jit, uint16_t address)
+{
+    return 0;
+}
+
+void jit_flush(struct jit* jit)
+{
+}
+
+uint16_t jit_sample_pc(struct vm* vm, void* context)
+{
+    return vm->reg[R_PC] - 1;
+}
+#endif
+
+// BATCH RUNNER
+// --batch=N runs N independent copies of the loaded image in this process on
+// a pool of worker threads, one VM per task. Each worker owns a deque of
+// instance numbers and takes work from its own tail; an idle worker steals
+// from the head of someone else's. Every instance reads its keys from its own
+// script (--batch-input, "%d" is replaced with the instance number), loaded
+// into memory up front, and writes its console output to --batch-output or
+// nowhere. All instances share the decoded instructions of the image, and
+// each worker keeps its VMs and resets them to the loaded image with
+// vm_restore() between instances. Usually that is one VM, but an instance
+// that sleeps in TRAP_WAIT does not hold up its worker: its VM leaves run()
+// suspended and is parked, the worker goes on with other instances on
+// another VM, and resumes it once it has something to wake up for.
+// Per-instance seconds count only running time.
+struct batch_queue
+{
+    pthread_mutex_t lock;
+    int* tasks;
+    int head;  // next task a thief takes
+    int tail;  // one past the next task the owner takes
+};
+
+struct batch_result
+{
+    uint64_t instr_count;
+    double seconds;
+    size_t out_bytes;
+};
+
+struct batch
+{
+    struct vm* image;           // loaded, never run
+    struct snapshot* start;     // the image as loaded
+    const char* input_pattern;
+    const char* output_pattern; // NULL discards output
+    int use_jit;
+    int workers;
+    struct batch_queue* queues;
+    struct batch_result* results;
+};
+
+struct batch_worker
+{
+    struct batch* batch;
+    int id;
+};
+
+// a VM of a worker and the instance on it, -1 when it is free
+struct batch_slot
+{
+    struct vm* vm;
+    int index;
+};
 
-                    update_flags(r0);
-                    break;
-                }
-            case OP_NOT:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7; // destination register (DR)
-                    uint16_t r1 = (instr >> 6) & 0x7; // first operand (SR1)
-                    
-                    reg[r0] = ~reg[r1];
-                    update_flags(r0);
-                    break;
-                }
-            case OP_BR:
-                {
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-                    uint16_t cond_flag = (instr >> 9) & 0x7; // n,z,p
-                    if (cond_flag & reg[R_COND]) {
-                        reg[R_PC] += pc_offset;
-                    }
-                    break;
-                }
-            case OP_JMP:
-                {
-                    // also handles RET
-                    uint16_t base_reg = (instr >> 6) & 0x7; // n,z,p
-                    reg[R_PC] = reg[base_reg];
-                    break;
-                }
-            case OP_JSR:
-                {
-                    uint16_t long_flag = (instr >> 11) & 1;
-                    reg[R_R7] = reg[R_PC];
-                    if (long_flag) {
-                        uint16_t pc_offset_11 = sign_extend(instr & 0x7FF, 11);
-                        reg[R_PC] += pc_offset_11;  // JSR
-                    }
-                    else {
-                        uint16_t base_reg = (instr >> 6) & 0x7;
-                        reg[R_PC] = reg[base_reg]; // JSRR
-                    }
-                    break;
-                }
-            case OP_LD:
-                {
-                    uint16_t dr = (instr >> 9) & 0x7; // destination register (DR)
-                    uint16_t pc_offset_9 = sign_extend(instr & 0x1FF, 9);
+// pattern with the first "%d" replaced by index
+void batch_path(char* out, size_t size, const char* pattern, int index)
+{
+    const char* at = strstr(pattern, "%d");
+    if (!at)
+    {
+        snprintf(out, size, "%s", pattern);
+        return;
+    }
+    snprintf(out, size, "%.*s%d%s", (int)(at - pattern), pattern, index, at + 2);
+}
 
-                    reg[dr] = mem_read(reg[R_PC] + pc_offset_9);
-                    update_flags(dr);
-                    break;
-                }
-            case OP_LDI: 
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7; // destination register
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9); // PC_offset_9 
-                    // add pc_offset to the current PC, look at that memory location to get the final address
-                    reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));
+int batch_take(struct batch* batch, int id)
+{
+    int task = -1;
+    struct batch_queue* own = &batch->queues[id];
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail)
+    {
+        task = own->tasks[--own->tail];
+    }
+    pthread_mutex_unlock(&own->lock);
 
-                    update_flags(r0);
-                    break;
-                }
-            case OP_LDR:
-                {   
-                    uint16_t dr = (instr >> 9) & 0x7; // destination register
-                    uint16_t br = (instr >> 6) & 0x7; // base register
-                    uint16_t pc_offset_6 = sign_extend(instr & 0x3F, 6);
+    // no new work is ever queued, so one sweep over empty queues means done
+    for (int k = 1; task < 0 && k < batch->workers; ++k)
+    {
+        struct batch_queue* victim = &batch->queues[(id + k) % batch->workers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail)
+        {
+            task = victim->tasks[victim->head++];
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return task;
+}
 
-                    reg[dr] = mem_read(reg[br] + pc_offset_6);
-                    update_flags(dr);
-                    break;
-                }
-            case OP_LEA:
-                {
-                    uint16_t dr = (instr >> 9) & 0x7; // destination register
-                    uint16_t pc_offset_9 = sign_extend(instr & 0x1FF, 9);
-                    
-                    reg[dr] = reg[R_PC] + pc_offset_9;
-                    update_flags(dr);
-                    break;
-                }
-            case OP_ST:
-                {
-                    uint16_t br = (instr >> 9) & 0x7;
-                    uint16_t pc_offset_9 = sign_extend(instr & 0x1FF, 9);
-                    mem_write(reg[R_PC] + pc_offset_9, reg[br]);
-                    break;
-                }
-            case OP_STI:
+void batch_start(struct batch* batch, struct vm* vm, int index)
+{
+    char path[4096];
+    vm_restore(vm, batch->start);
+    vm->instr_count = 0;
+    vm->idle_spins = 0;
+    vm->timer_ms = 0;
+    vm->wake_seen = atomic_load(&wake_signals);
+    atomic_store(&vm->input.head, 0);
+    atomic_store(&vm->input.tail, 0);
+    atomic_store(&vm->input.eof, 0);
+    vm->input_inline = 0;
+    vm->input_done = 0;
+    vm->out_bytes = 0;
+    free(vm->fb_shown); // the first frame is drawn in full
+    vm->fb_shown = NULL;
+
+    batch_path(path, sizeof(path), batch->input_pattern, index);
+    if (!vm_load_script(vm, path))
+    {
+        fprintf(stderr, "instance %d: cannot open input %s\n", index, path);
+        exit(1);
+    }
+    vm->out_fd = -1;
+    if (batch->output_pattern)
+    {
+        batch_path(path, sizeof(path), batch->output_pattern, index);
+        vm->out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (vm->out_fd < 0)
+        {
+            fprintf(stderr, "instance %d: cannot open output %s\n", index, path);
+            exit(1);
+        }
+    }
+    start_input(vm);
+    batch->results[index].seconds = 0;
+}
+
+// runs the instance until it halts or suspends, returns 1 once it halted
+int batch_run(struct batch* batch, struct vm* vm, int index)
+{
+    double start = now_seconds();
+#if LC3_JIT
+    if (batch->use_jit)
+    {
+        run_jit(vm);
+    }
+    else
+#endif
+    {
+        run(vm);
+    }
+    out_flush(vm);
+
+    struct batch_result* result = &batch->results[index];
+    result->seconds += now_seconds() - start;
+    if (vm->suspended)
+    {
+        return 0;
+    }
+    result->instr_count = vm->instr_count;
+    result->out_bytes = vm->out_bytes;
+    if (vm->out_fd >= 0)
+    {
+        close(vm->out_fd);
+    }
+    return 1;
+}
+
+void* batch_worker(void* arg)
+{
+    struct batch_worker* worker = arg;
+    struct batch* batch = worker->batch;
+    struct batch_slot* slots = NULL;
+    int slot_count = 0;
+
+    for (;;)
+    {
+        // a parked instance with something to wake up for goes first
+        int next = -1;
+        int free_slot = -1;
+        int parked = 0;
+        int sleep_ms = WAIT_SLICE_MS;
+        for (int i = 0; i < slot_count && next < 0; ++i)
+        {
+            if (slots[i].index < 0)
+            {
+                free_slot = i;
+                continue;
+            }
+            uint16_t events = wait_events(slots[i].vm);
+            if (events)
+            {
+                wait_resume(slots[i].vm, events);
+                next = i;
+                break;
+            }
+            int ms = wait_timeout_ms(slots[i].vm);
+            sleep_ms = ms < sleep_ms ? ms : sleep_ms;
+            ++parked;
+        }
+
+        if (next < 0)
+        {
+            int task = batch_take(batch, worker->id);
+            if (task < 0)
+            {
+                if (!parked)
                 {
-                    uint16_t br = (instr >> 9) & 0x7;
-                    uint16_t pc_offset_9 = sign_extend(instr & 0x1FF, 9);
-                    mem_write(mem_read(reg[R_PC] + pc_offset_9), reg[br]);
                     break;
                 }
-            case OP_STR:
+                usleep(sleep_ms * 1000); // everything left is asleep
+                continue;
+            }
+            if (free_slot < 0)
+            {
+                slots = realloc(slots, ++slot_count * sizeof(struct batch_slot));
+                free_slot = slot_count - 1;
+                struct vm* vm = vm_create();
+                // load the image before sharing its decoded instructions, so
+                // that the words loaded do not make this VM unshare them
+                vm_restore(vm, batch->start);
+                vm_share_code(vm, batch->image);
+                vm->out_limit = batch->image->out_limit;
+                vm->out_interval_ms = batch->image->out_interval_ms;
+                vm->intrinsics = batch->image->intrinsics;
+                vm->yield_waits = 1;
+                slots[free_slot].vm = vm;
+            }
+            next = free_slot;
+            slots[next].index = task;
+            batch_start(batch, slots[next].vm, task);
+        }
+
+        if (batch_run(batch, slots[next].vm, slots[next].index))
+        {
+            slots[next].index = -1;
+        }
+    }
+    for (int i = 0; i < slot_count; ++i)
+    {
+        vm_destroy(slots[i].vm);
+    }
+    free(slots);
+    return NULL;
+}
+
+void run_batch(struct vm* image, int count, int workers, const char* input_pattern,
+               const char* output_pattern, int use_jit)
+{
+    if (workers > count)
+    {
+        workers = count;
+    }
+    struct batch batch = { image, NULL, input_pattern, output_pattern, use_jit, workers };
+    batch.queues = calloc(workers, sizeof(struct batch_queue));
+    batch.results = calloc(count, sizeof(struct batch_result));
+    for (int w = 0; w < workers; ++w)
+    {
+        pthread_mutex_init(&batch.queues[w].lock, NULL);
+        batch.queues[w].tasks = malloc(count * sizeof(int));
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        struct batch_queue* q = &batch.queues[i % workers];
+        q->tasks[q->tail++] = i;
+    }
+
+    // decode the image once up front so no instance has to
+    code_cache_prepare(image);
+    batch.start = vm_snapshot(image);
+
+    pthread_t* threads = malloc(workers * sizeof(pthread_t));
+    struct batch_worker* args = malloc(workers * sizeof(struct batch_worker));
+    double start = now_seconds();
+    for (int w = 0; w < workers; ++w)
+    {
+        args[w] = (struct batch_worker){ &batch, w };
+        pthread_create(&threads[w], NULL, batch_worker, &args[w]);
+    }
+    for (int w = 0; w < workers; ++w)
+    {
+        pthread_join(threads[w], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    uint64_t total = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        const struct batch_result* r = &batch.results[i];
+        printf("instance %d: %llu instructions, %.6f seconds, %zu output bytes\n",
+               i, (unsigned long long)r->instr_count, r->seconds, r->out_bytes);
+        total += r->instr_count;
+    }
+    printf("instances: %d\n", count);
+    printf("threads: %d\n", workers);
+    printf("instructions: %llu\n", (unsigned long long)total);
+    printf("seconds: %.6f\n", elapsed);
+    printf("instructions/sec: %.0f\n", elapsed > 0 ? total / elapsed : 0.0);
+
+    for (int w = 0; w < workers; ++w)
+    {
+        pthread_mutex_destroy(&batch.queues[w].lock);
+        free(batch.queues[w].tasks);
+    }
+    free(batch.queues);
+    free(batch.results);
+    free(batch.start);
+    free(threads);
+    free(args);
+}
+
+// AHEAD-OF-TIME TRANSLATION
+// --aot=FILE.c writes the loaded image out as a C program that runs without
+// this VM: every word reachable from the PC (through branches, calls and
+// fall-through, as in code_cache_prepare()) becomes a C statement, basic
+// blocks get a label each, and JMP/RET/JSRR go through a switch on the target
+// PC. The registers are locals so the C compiler can keep them in machine
+// registers; flags are the same lazy last-result as the interpreter.
+// Stores into translated code, and jumps to words that were not found by the
+// traversal, stop the program with an error, since there is nothing to run
+// them with.
+const char* aot_runtime =
+    "#include <poll.h>\n"
+    "#include <signal.h>\n"
+    "#include <stdint.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <termios.h>\n"
+    "#include <time.h>\n"
+    "#include <unistd.h>\n"
+    "\n"
+    "static uint16_t mem[65536];\n"
+    "static int is_code(uint16_t a);\n"
+    "\n"
+    "static char out_buf[1 << 16];\n"
+    "static size_t out_len;\n"
+    "static unsigned char in_buf[4096];\n"
+    "static size_t in_pos, in_len;\n"
+    "static int in_eof, eof_read, idle;\n"
+    "static struct termios tio;\n"
+    "static int tty;\n"
+    "static double timer_due;\n"
+    "static volatile sig_atomic_t woken;\n"
+    "\n"
+    "static inline void out_flush(void)\n"
+    "{\n"
+    "    size_t done = 0;\n"
+    "    while (done < out_len) {\n"
+    "        ssize_t n = write(1, out_buf + done, out_len - done);\n"
+    "        if (n <= 0) break;\n"
+    "        done += n;\n"
+    "    }\n"
+    "    out_len = 0;\n"
+    "}\n"
+    "\n"
+    "static inline void out_putc(char c)\n"
+    "{\n"
+    "    if (out_len == sizeof(out_buf)) out_flush();\n"
+    "    out_buf[out_len++] = c;\n"
+    "}\n"
+    "\n"
+    "static inline void out_puts(const char* s)\n"
+    "{\n"
+    "    while (*s) out_putc(*s++);\n"
+    "}\n"
+    "\n"
+    "static inline void out_trap_done(void)\n"
+    "{\n"
+    "    if (out_len >= 4096) out_flush();\n"
+    "}\n"
+    "\n"
+    "static inline void finish(int status)\n"
+    "{\n"
+    "    out_flush();\n"
+    "    if (tty) tcsetattr(0, TCSANOW, &tio);\n"
+    "    exit(status);\n"
+    "}\n"
+    "\n"
+    "static inline void on_interrupt(int signal)\n"
+    "{\n"
+    "    out_putc('\\n');\n"
+    "    finish(-2);\n"
+    "}\n"
+    "\n"
+    "static inline void on_wake(int signal)\n"
+    "{\n"
+    "    woken = 1;\n"
+    "}\n"
+    "\n"
+    "static inline void start(void)\n"
+    "{\n"
+    "    if (tcgetattr(0, &tio) == 0) {\n"
+    "        struct termios raw = tio;\n"
+    "        raw.c_lflag &= ~ICANON & ~ECHO;\n"
+    "        tcsetattr(0, TCSANOW, &raw);\n"
+    "        tty = 1;\n"
+    "    }\n"
+    "    signal(SIGINT, on_interrupt);\n"
+    "    signal(SIGUSR2, on_wake);\n"
+    "}\n"
+    "\n"
+    "static inline double now(void)\n"
+    "{\n"
+    "    struct timespec ts;\n"
+    "    clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+    "    return ts.tv_sec + ts.tv_nsec / 1e9;\n"
+    "}\n"
+    "\n"
+    "// 1 once a key or EOF is waiting, waiting up to timeout_ms for one\n"
+    "static inline int key_ready(int timeout_ms)\n"
+    "{\n"
+    "    if (in_pos < in_len || in_eof) return 1;\n"
+    "    struct pollfd p = { 0, POLLIN, 0 };\n"
+    "    if (poll(&p, 1, timeout_ms) <= 0) return 0;\n"
+    "    ssize_t n = read(0, in_buf, sizeof(in_buf));\n"
+    "    if (n <= 0) in_eof = 1;\n"
+    "    else { in_pos = 0; in_len = n; }\n"
+    "    return 1;\n"
+    "}\n"
+    "\n"
+    "// blocks until a key arrives, -1 at end of input\n"
+    "static inline int key_getc(void)\n"
+    "{\n"
+    "    out_flush();\n"
+    "    while (!key_ready(-1)) {}\n"
+    "    if (in_pos < in_len) return in_buf[in_pos++];\n"
+    "    eof_read = 1;\n"
+    "    return -1;\n"
+    "}\n"
+    "\n"
+    "// c is the last result, which PSR reads as N/Z/P in user mode\n"
+    "static inline uint16_t rd(uint16_t a, uint16_t c)\n"
+    "{\n"
+    "    if (a == 0xFE00) {\n"
+    "        if (mem[0xFE00] >> 15) {}\n"
+    "        else if (key_ready(0)) {\n"
+    "            idle = 0;\n"
+    "            mem[0xFE00] |= 1 << 15;\n"
+    "            mem[0xFE02] = (uint16_t)key_getc();\n"
+    "        }\n"
+    "        else {\n"
+    "            out_flush();\n"
+    "            if (++idle == 64) { idle = 0; key_ready(100); }\n"
+    "        }\n"
+    "    }\n"
+    "    else if (a == 0xFE02) mem[0xFE00] &= ~(1 << 15);\n"
+    "    else if (a == 0xFE04) return 1 << 15;\n"
+    "    else if (a == 0xFE08) {\n"
+    "        if (!mem[0xFE0A] || now() < timer_due) return 0;\n"
+    "        timer_due = now() + mem[0xFE0A] / 1000.0;\n"
+    "        return 1 << 15;\n"
+    "    }\n"
+    "    else if (a == 0xFFFC) return 1 << 15 | ((int16_t)c < 0 ? 4 : c ? 1 : 2);\n"
+    "    else if (a == 0xFFFE) return mem[a] | 1 << 15;\n"
+    "    return mem[a];\n"
+    "}\n"
+    "\n"
+    "static inline void st(uint16_t a, uint16_t v)\n"
+    "{\n"
+    "    if (is_code(a)) {\n"
+    "        out_flush();\n"
+    "        fprintf(stderr, \"store to translated code at x%04X\\n\", a);\n"
+    "        finish(1);\n"
+    "    }\n"
+    "    if (a == 0xFE00) mem[a] = (mem[a] & 1 << 15) | (v & 1 << 14);\n"
+    "    else mem[a] = v;\n"
+    "    if (a == 0xFE06) { out_putc((char)v); out_trap_done(); }\n"
+    "    else if (a == 0xFE0A) timer_due = now() + v / 1000.0;\n"
+    "    else if (a == 0xFFFE && !(v >> 15)) finish(0);\n"
+    "}\n"
+    "\n"
+    "static inline void bad_jump(uint16_t pc)\n"
+    "{\n"
+    "    out_flush();\n"
+    "    fprintf(stderr, \"jump to untranslated code at x%04X\\n\", pc);\n"
+    "    finish(1);\n"
+    "}\n"
+    "\n"
+    "static inline void trap_puts(uint16_t a)\n"
+    "{\n"
+    "    for (; mem[a]; ++a) out_putc((char)mem[a]);\n"
+    "    out_trap_done();\n"
+    "}\n"
+    "\n"
+    "static inline void trap_putsp(uint16_t a)\n"
+    "{\n"
+    "    for (; mem[a]; ++a) {\n"
+    "        out_putc((char)(mem[a] & 0xFF));\n"
+    "        if (mem[a] >> 8) out_putc((char)(mem[a] >> 8));\n"
+    "    }\n"
+    "    out_trap_done();\n"
+    "}\n"
+    "\n"
+    "static inline uint16_t trap_in(void)\n"
+    "{\n"
+    "    out_puts(\"*** Enter a character: \");\n"
+    "    char c = key_getc();\n"
+    "    out_puts(\"\\nRead character: \");\n"
+    "    out_putc(c);\n"
+    "    out_putc('\\n');\n"
+    "    out_putc(c);\n"
+    "    out_trap_done();\n"
+    "    return (uint16_t)c;\n"
+    "}\n"
+    "\n"
+    "// sleeps until a key (1), the timer (2) or SIGUSR2 (4), in 50ms slices\n"
+    "static inline uint16_t trap_wait(void)\n"
+    "{\n"
+    "    out_flush();\n"
+    "    for (;;) {\n"
+    "        uint16_t events = 0;\n"
+    "        if (mem[0xFE00] >> 15 || in_pos < in_len || (!eof_read && key_ready(0))) events |= 1;\n"
+    "        else if (eof_read && !mem[0xFE0A]) events |= 1; // nothing else could wake it\n"
+    "        if (mem[0xFE0A] && now() >= timer_due) events |= 2;\n"
+    "        if (woken) { woken = 0; events |= 4; }\n"
+    "        if (events) return events;\n"
+    "        int ms = 50;\n"
+    "        double left = (timer_due - now()) * 1000;\n"
+    "        if (mem[0xFE0A] && left < ms) ms = left > 0 ? (int)left + 1 : 0;\n"
+    "        if (eof_read) poll(NULL, 0, ms);\n"
+    "        else key_ready(ms);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static inline void trap_halt(void)\n"
+    "{\n"
+    "    out_puts(\"Thanks for playing!\\n\");\n"
+    "    finish(0);\n"
+    "}\n"
+    "\n";
+
+// a jump to target: straight to its label, or through the dispatch switch
+// when the traversal never reached it
+void aot_goto(FILE* out, const uint8_t* label, uint16_t target)
+{
+    if (label[target])
+    {
+        fprintf(out, "goto L%04X;", target);
+    }
+    else
+    {
+        fprintf(out, "{ pc = 0x%04X; goto dispatch; }", target);
+    }
+}
+
+// condition for a BR with n/z/p mask nzp, C holds the last result
+const char* aot_condition(int nzp)
+{
+    static const char* conditions[8] = {
+        "0", "(int16_t)C > 0", "C == 0", "(int16_t)C >= 0",
+        "(int16_t)C < 0", "C != 0", "(int16_t)C <= 0", "1"
+    };
+    return conditions[nzp];
+}
+
+// a read of address that is a constant in the translated code
+void aot_read_const(FILE* out, uint16_t address)
+{
+    if (address >= MR_KBSR)
+    {
+        fprintf(out, "rd(0x%04X, C)", address);
+    }
+    else
+    {
+        fprintf(out, "mem[0x%04X]", address);
+    }
+}
+
+void aot_instruction(FILE* out, const struct decoded* d, uint16_t pc, const uint8_t* label)
+{
+    uint16_t next = pc + 1;
+    switch (d->op)
+    {
+        case OP_ADD:
+            fprintf(out, "R%d = R%d + R%d; C = R%d;", d->r0, d->r1, d->r2, d->r0);
+            break;
+        case OP_ADDI:
+            fprintf(out, "R%d = R%d + 0x%04X; C = R%d;", d->r0, d->r1, d->imm, d->r0);
+            break;
+        case OP_AND:
+            fprintf(out, "R%d = R%d & R%d; C = R%d;", d->r0, d->r1, d->r2, d->r0);
+            break;
+        case OP_ANDI:
+            fprintf(out, "R%d = R%d & 0x%04X; C = R%d;", d->r0, d->r1, d->imm, d->r0);
+            break;
+        case OP_NOT:
+            fprintf(out, "R%d = ~R%d; C = R%d;", d->r0, d->r1, d->r0);
+            break;
+        case OP_BR:
+            if (d->r0)
+            {
+                if (d->r0 != (FL_NEG | FL_ZRO | FL_POS))
                 {
-                    uint16_t br = (instr >> 9) & 0x7;
-                    uint16_t sr = (instr >> 6) & 0x7; // source register
-                    uint16_t offset6 = sign_extend(instr & 0x3F, 6);
-                    mem_write(reg[sr] + offset6, reg[br]);
-                    break;
+                    fprintf(out, "if (%s) ", aot_condition(d->r0));
                 }
-            case OP_TRAP:
-                {
-                    reg[R_R7] = reg[R_PC];
+                aot_goto(out, label, d->imm);
+            }
+            break;
+        case OP_JMP:
+            fprintf(out, "pc = R%d; goto dispatch;", d->r1);
+            break;
+        case OP_JSR:
+            fprintf(out, "R7 = 0x%04X; ", next);
+            aot_goto(out, label, d->imm);
+            break;
+        case OP_JSRR:
+            fprintf(out, "pc = R%d; R7 = 0x%04X; goto dispatch;", d->r1, next);
+            break;
+        case OP_LD:
+            fprintf(out, "R%d = ", d->r0);
+            aot_read_const(out, d->imm);
+            fprintf(out, "; C = R%d;", d->r0);
+            break;
+        case OP_LDI:
+            fprintf(out, "R%d = rd(", d->r0);
+            aot_read_const(out, d->imm);
+            fprintf(out, ", C); C = R%d;", d->r0);
+            break;
+        case OP_LDR:
+            fprintf(out, "R%d = rd(R%d + 0x%04X, C); C = R%d;", d->r0, d->r1, d->imm, d->r0);
+            break;
+        case OP_LEA:
+            fprintf(out, "R%d = 0x%04X; C = R%d;", d->r0, d->imm, d->r0);
+            break;
+        case OP_ST:
+            fprintf(out, "st(0x%04X, R%d);", d->imm, d->r0);
+            break;
+        case OP_STI:
+            fprintf(out, "st(");
+            aot_read_const(out, d->imm);
+            fprintf(out, ", R%d);", d->r0);
+            break;
+        case OP_STR:
+            fprintf(out, "st(R%d + 0x%04X, R%d);", d->r1, d->imm, d->r0);
+            break;
+        case OP_TRAP:
+            fprintf(out, "R7 = 0x%04X; ", next);
+            switch (d->imm)
+            {
+                case TRAP_GETC: fprintf(out, "R0 = (uint16_t)key_getc(); C = R0;"); break;
+                case TRAP_OUT: fprintf(out, "out_putc((char)R0); out_trap_done();"); break;
+                case TRAP_PUTS: fprintf(out, "trap_puts(R0);"); break;
+                case TRAP_IN: fprintf(out, "R0 = trap_in(); C = R0;"); break;
+                case TRAP_PUTSP: fprintf(out, "trap_putsp(R0);"); break;
+                case TRAP_HALT: fprintf(out, "trap_halt();"); break;
+                case TRAP_WAIT: fprintf(out, "R0 = trap_wait(); C = R0;"); break;
+            }
+            break;
+        default: // RTI, RES
+            fprintf(out, "finish(134);");
+            break;
+    }
+}
 
-                    switch (instr & 0xFF)
-                    {
-                        case TRAP_GETC: // read a single ASCII char
-                            {
-                                reg[R_R0] = (uint16_t)getchar();
-                                update_flags(R_R0);
-                                break;
-                            }
-                        case TRAP_OUT: // output a character
-                            {
-                                putc((char)reg[R_R0], stdout);
-                                fflush(stdout);
-                                break;
-                            }
-                        case TRAP_PUTS: // output a null terminated string
-                            {
-                                uint16_t* c = memory + reg[R_R0];
-                                while (*c)
-                                {
-                                    putc((char)*c, stdout);
-                                    ++c;
-                                }
-                                fflush(stdout);
-                                break;
-                            }
-                        case TRAP_IN: // input character
-                            {
-                                printf("*** Enter a character: ");
-                                char c = getchar();
-                                printf("\nRead character: %c\n", c); // Debug print
-                                putc(c, stdout);
-                                fflush(stdout);
-                                reg[R_R0] = (uint16_t)c;
-                                update_flags(R_R0);
-                                break;
-
-                            }
-                        case TRAP_PUTSP: // output string
-                            {
-                                /* one char per byte (two bytes per word)
-                                here we need to swap back to big endian format */
-                                uint16_t* c = memory + reg[R_R0];
-                                while (*c)
-                                {
-                                    char char1 = (*c) & 0xFF;
-                                    putc(char1, stdout);
-                                    char char2 = (*c) >> 8;
-                                    if (char2) putc(char2, stdout);
-                                    ++c;
-                                }
-                                fflush(stdout);
-                                break;
-                            }
-                        case TRAP_HALT: // halt program
-                            {
-                                puts("Thanks for playing!");
-                                fflush(stdout);
-                                running = 0;
-                                break;
-                            }
-                    }
-                    break;
-                }
-            case OP_RES:
-            case OP_RTI:
-            default:
-                { 
-                    abort();
-                    break;
-                }
+// write the image loaded into vm as a C program, returns 0 on failure
+int aot_translate(struct vm* vm, const char* path)
+{
+    FILE* out = fopen(path, "w");
+    if (!out)
+    {
+        return 0;
+    }
+    uint8_t* code = calloc(MEMORY_MAX, 1);
+    uint8_t* label = calloc(MEMORY_MAX, 1);
+    uint16_t* work = malloc(MEMORY_MAX * sizeof(uint16_t));
+    struct decoded d;
+
+    // CFG: a block starts at every jump target and after every branch, call
+    // and trap, so that return addresses are labels too
+    int n = 0;
+    work[n++] = vm->reg[R_PC];
+    label[vm->reg[R_PC]] = 1;
+    while (n > 0)
+    {
+        uint16_t pc = work[--n];
+        while (pc < MR_KBSR && !code[pc])
+        {
+            decode_word(&d, vm->memory[pc], pc);
+            code[pc] = 1;
+            uint16_t next = pc + 1;
+            if ((d.op == OP_BR && d.r0) || d.op == OP_JSR)
+            {
+                label[d.imm] = 1;
+                work[n++] = d.imm;
+            }
+            if (d.op == OP_BR || d.op == OP_JSR || d.op == OP_JSRR || d.op == OP_TRAP)
+            {
+                label[next] = 1;
+            }
+            if ((d.op == OP_BR && d.r0 == (FL_NEG | FL_ZRO | FL_POS))
+                || d.op == OP_JMP || d.op == OP_RTI || d.op == OP_RES
+                || (d.op == OP_TRAP && d.imm == TRAP_HALT))
+            {
+                break; // no fall-through
+            }
+            pc = next;
+        }
+    }
+    for (int a = 0; a < MEMORY_MAX; ++a)
+    {
+        // labels only on code; the first word of a run is always a jump target
+        label[a] = code[a] && (label[a] || a == 0 || !code[a - 1]);
+    }
+
+    fprintf(out, "// translated from an LC-3 image by lc3 --aot\n%s", aot_runtime);
+
+    fprintf(out, "static int is_code(uint16_t a)\n{\n    return 0");
+    for (int a = 0; a < MEMORY_MAX; ++a)
+    {
+        if (code[a] && (a == 0 || !code[a - 1]))
+        {
+            int end = a;
+            while (end < MEMORY_MAX && code[end])
+            {
+                ++end;
+            }
+            fprintf(out, "\n        || (a >= 0x%04X && a <= 0x%04X)", a, end - 1);
+        }
+    }
+    fprintf(out, ";\n}\n\nint main(void)\n{\n");
+
+    int words = 0;
+    fprintf(out, "    static const struct { uint16_t at, value; } image[] = {");
+    for (int a = 0; a < MEMORY_MAX; ++a)
+    {
+        if (vm->memory[a])
+        {
+            fprintf(out, "%s{ 0x%04X, 0x%04X },", words++ % 6 ? " " : "\n        ", a, vm->memory[a]);
+        }
+    }
+    fprintf(out, "\n    };\n");
+    fprintf(out, "    for (size_t i = 0; i < sizeof(image) / sizeof(image[0]); ++i) mem[image[i].at] = image[i].value;\n");
+    fprintf(out, "    uint16_t R0 = 0, R1 = 0, R2 = 0, R3 = 0, R4 = 0, R5 = 0, R6 = 0, R7 = 0;\n");
+    fprintf(out, "    uint16_t C = 0; // last result written to a register, for BR\n");
+    fprintf(out, "    (void)R0; (void)R1; (void)R2; (void)R3; (void)R4; (void)R5; (void)R6; (void)R7; (void)C;\n");
+    fprintf(out, "    uint16_t pc = 0x%04X;\n", vm->reg[R_PC]);
+    fprintf(out, "    start();\n    goto dispatch;\n\n");
+
+    for (int a = 0; a < MEMORY_MAX; ++a)
+    {
+        if (!code[a])
+        {
+            continue;
+        }
+        if (label[a])
+        {
+            fprintf(out, "L%04X:\n", a);
+        }
+        decode_word(&d, vm->memory[a], a);
+        if (d.op == OP_ST && code[d.imm])
+        {
+            fprintf(stderr, "warning: x%04X stores into translated code at x%04X\n", a, d.imm);
+        }
+        fprintf(out, "    ");
+        aot_instruction(out, &d, a, label);
+        fprintf(out, "\n");
+        if (a + 1 == MEMORY_MAX || !code[a + 1])
+        {
+            fprintf(out, "    pc = 0x%04X; goto dispatch;\n", (uint16_t)(a + 1));
+        }
+    }
+
+    fprintf(out, "\ndispatch:\n    switch (pc) {\n");
+    for (int a = 0; a < MEMORY_MAX; ++a)
+    {
+        if (label[a])
+        {
+            fprintf(out, "        case 0x%04X: goto L%04X;\n", a, a);
+        }
+    }
+    fprintf(out, "    }\n    bad_jump(pc);\n    return 1;\n}\n");
+
+    free(code);
+    free(label);
+    free(work);
+    return fclose(out) == 0;
+}
+
+int main(int argc, const char* argv[])
+{
+    struct vm* vm = vm_create();
+
+    // LOAD ARGS
+    int images = 0;
+    int use_jit = 0;
+    int batch = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* batch_input = NULL;
+    const char* batch_output = NULL;
+    int headless = 0;
+    const char* aot_path = NULL;
+    int sample_hz = 1000;
+    for (int j = 1; j < argc; ++j) {
+        if (strcmp(argv[j], "--stats") == 0) {
+            show_stats = 1;
+            continue;
+        }
+        if (strncmp(argv[j], "--out-bytes=", 12) == 0) {
+            vm->out_limit = strtoul(argv[j] + 12, NULL, 10);
+            continue;
+        }
+        if (strncmp(argv[j], "--out-ms=", 9) == 0) {
+            vm->out_interval_ms = atoi(argv[j] + 9);
+            continue;
+        }
+        if (strncmp(argv[j], "--batch=", 8) == 0) {
+            batch = atoi(argv[j] + 8);
+            continue;
+        }
+        if (strncmp(argv[j], "--threads=", 10) == 0) {
+            threads = atoi(argv[j] + 10);
+            continue;
+        }
+        if (strncmp(argv[j], "--batch-input=", 14) == 0) {
+            batch_input = argv[j] + 14;
+            continue;
+        }
+        if (strncmp(argv[j], "--batch-output=", 15) == 0) {
+            batch_output = argv[j] + 15;
+            continue;
+        }
+        if (strncmp(argv[j], "--profile=", 10) == 0) {
+            profile_path = argv[j] + 10;
+            continue;
+        }
+        if (strncmp(argv[j], "--folded=", 9) == 0) {
+            folded_path = argv[j] + 9;
+            continue;
+        }
+        if (strncmp(argv[j], "--sample=", 9) == 0) {
+            sample_path = argv[j] + 9;
+            continue;
+        }
+        if (strncmp(argv[j], "--sample-hz=", 12) == 0) {
+            sample_hz = atoi(argv[j] + 12);
+            continue;
+        }
+        if (strncmp(argv[j], "--symbols=", 10) == 0) {
+            if (!load_symbols(argv[j] + 10)) {
+                printf("failed to read symbols: %s\n", argv[j] + 10);
+                exit(1);
+            }
+            continue;
+        }
+        if (strcmp(argv[j], "--counters") == 0) {
+            vm->counters = counters_create(NULL);
+            continue;
+        }
+        if (strncmp(argv[j], "--counters=", 11) == 0) {
+            vm->counters = counters_create(argv[j] + 11);
+            continue;
+        }
+        if (strncmp(argv[j], "--read-counters=", 16) == 0) {
+            return read_counters(argv[j] + 16);
+        }
+        if (strcmp(argv[j], "--headless") == 0) {
+            headless = 1;
+            continue;
+        }
+        if (strncmp(argv[j], "--input=", 8) == 0) {
+            if (!vm_load_script(vm, argv[j] + 8)) {
+                printf("failed to read input: %s\n", argv[j] + 8);
+                exit(1);
+            }
+            continue;
+        }
+        if (strncmp(argv[j], "--keys=", 7) == 0) {
+            vm_set_script(vm, argv[j] + 7, strlen(argv[j] + 7));
+            continue;
+        }
+        if (strncmp(argv[j], "--output=", 9) == 0) {
+            vm->out_fd = open(argv[j] + 9, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (vm->out_fd < 0) {
+                printf("failed to open output: %s\n", argv[j] + 9);
+                exit(1);
+            }
+            continue;
+        }
+        if (strncmp(argv[j], "--record=", 9) == 0) {
+            if (!record_open(vm, argv[j] + 9)) {
+                printf("failed to create recording: %s\n", argv[j] + 9);
+                exit(1);
+            }
+            continue;
+        }
+        if (strncmp(argv[j], "--replay=", 9) == 0) {
+            if (!replay_load(vm, argv[j] + 9)) {
+                printf("failed to read recording: %s\n", argv[j] + 9);
+                exit(1);
+            }
+            continue;
+        }
+        if (strncmp(argv[j], "--aot=", 6) == 0) {
+            aot_path = argv[j] + 6;
+            continue;
+        }
+        if (strcmp(argv[j], "--intrinsics") == 0) {
+            vm->intrinsics = 1;
+            continue;
+        }
+        if (strcmp(argv[j], "--intrinsics=check") == 0) {
+            vm->intrinsics = 2;
+            continue;
+        }
+        if (strcmp(argv[j], "--jit") == 0) {
+            if (!LC3_JIT) {
+                printf("--jit is only available on x86-64\n");
+                exit(2);
+            }
+            use_jit = 1;
+            continue;
+        }
+        if (!read_image(vm, argv[j])) {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+        ++images;
+    }
+
+    if (images == 0) {
+        // show usage string
+        printf("Not enough arguments! ex: ./lc3-vm [--stats] [--jit] 2048.obj\n");
+        exit(2);
+    }
+
+    if (aot_path) {
+        if (!aot_translate(vm, aot_path)) {
+            printf("failed to write translation: %s\n", aot_path);
+            exit(1);
+        }
+        return 0;
+    }
+    if (batch > 0) {
+        signal(SIGUSR2, handle_usr2);
+        if (!batch_input) {
+            printf("--batch needs --batch-input=moves-%%d.txt\n");
+            exit(2);
         }
+        run_batch(vm, batch, threads > 0 ? threads : 1, batch_input, batch_output, use_jit);
+        return 0;
+    }
+    if (profile_path || folded_path) {
+        if (use_jit) {
+            printf("--profile and --folded need the interpreter, not --jit\n");
+            exit(2);
+        }
+        vm->profile = profile_create(vm->reg[R_PC]);
+    }
+
+    // SETUP
+    console_vm = vm;
+    signal(SIGINT, handle_interrupt);
+    signal(SIGUSR1, handle_usr1);
+    signal(SIGUSR2, handle_usr2);
+    if (sample_path) {
+        sample_start(vm, sample_hz > 0 && sample_hz <= 1000000 ? sample_hz : 1000);
+    }
+    if (!headless) {
+        disable_input_buffering(vm);
+    }
+    start_input(vm);
+
+    // LOOP
+    const char* engine = ENGINE_NAME;
+    struct host_counters host;
+    if (show_stats) {
+        host_counters_start(&host);
+    }
+    double start = now_seconds();
+#if LC3_JIT
+    if (use_jit) {
+        engine = "jit";
+        run_jit(vm);
+    }
+    else
+#endif
+    {
+        run(vm);
+    }
+    double elapsed = now_seconds() - start;
+    if (show_stats) {
+        host_counters_stop(&host);
+    }
+
+    out_flush(vm);
+    restore_input_buffering(vm);
+    profile_save(vm);
+    sample_save(vm);
+    if (vm->record) {
+        fclose(vm->record);
+    }
+    if (vm->counters) {
+        write_counters(STDERR_FILENO, vm->counters);
     }
 
-    restore_input_buffering();
-}
\ No newline at end of file
+    if (show_stats) {
+        print_stats(vm, engine, elapsed, &host);
+    }
+}
@@ -0,0 +1,26 @@
+; fb: fills the first two framebuffer rows and presents, then changes the
+; last cell of row 1 and the first of row 2 and presents again. Each row
+; must start with its own cursor move.
+.ORIG x3000
+        LD R0, CELL
+        LD R1, FB
+        LD R2, COUNT
+FILL    STR R0, R1, #0
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp FILL
+        STI R0, FBCR
+        LD R0, CHANGE
+        LD R1, FB
+        ADD R1, R1, #15
+        ADD R1, R1, #15
+        STR R0, R1, #1      ; row 1, column 32
+        STR R0, R1, #2      ; row 2, column 1
+        STI R0, FBCR
+        HALT
+CELL    .FILL x41
+CHANGE  .FILL x42
+FB      .FILL xFE40
+FBCR    .FILL xFE10
+COUNT   .FILL #64
+.END
@@ -0,0 +1,26 @@
+; psr: loads that read PSR right after an instruction that set the condition
+; codes, which the JIT must not treat as dead. Prints "14".
+.ORIG x3000
+        AND R1, R1, #0
+        ADD R1, R1, #1      ; P
+        LDI R0, PSR
+        JSR DIGIT
+        LD R2, PSR
+        ADD R1, R1, #-2     ; N
+        LDR R0, R2, #0
+        JSR DIGIT
+        LD R0, NEWLINE
+        OUT
+        HALT
+DIGIT   ST R7, SAVE7        ; prints the N/Z/P bits of R0 as a digit
+        AND R0, R0, #7
+        LD R3, ZERO
+        ADD R0, R0, R3
+        OUT
+        LD R7, SAVE7
+        RET
+SAVE7   .FILL 0
+PSR     .FILL xFFFC
+ZERO    .FILL x30
+NEWLINE .FILL x0A
+.END
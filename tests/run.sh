@@ -0,0 +1,50 @@
+#!/bin/sh
+# usage: tests/run.sh
+#
+# Builds lc3.c (also with -DLC3_EAGER_FLAGS), runs every tests/*.obj under
+# the interpreter, the JIT on x86-64 and as an --aot translation, and compares
+# the guest output with tests/NAME.out, or tests/NAME.aot.out for --aot where
+# that exists. Exits 1 if any run differs.
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+$CC $CFLAGS -pthread "$here/../lc3.c" -o "$work/lc3"
+$CC $CFLAGS -pthread -DLC3_EAGER_FLAGS "$here/../lc3.c" -o "$work/lc3-eager"
+engines="interp eager aot"
+if [ "$(uname -m)" = x86_64 ]; then
+    engines="$engines jit jit-eager"
+fi
+
+failed=0
+for image in "$here"/*.obj; do
+    name=$(basename "$image" .obj)
+    for engine in $engines; do
+        expected=$here/$name.out
+        case $engine in
+            interp) set -- "$work/lc3" --headless "$image" ;;
+            eager) set -- "$work/lc3-eager" --headless "$image" ;;
+            jit) set -- "$work/lc3" --jit --headless "$image" ;;
+            jit-eager) set -- "$work/lc3-eager" --jit --headless "$image" ;;
+            aot)
+                "$work/lc3" --aot="$work/$name.c" "$image"
+                $CC $CFLAGS "$work/$name.c" -o "$work/$name"
+                set -- "$work/$name"
+                if [ -f "$here/$name.aot.out" ]; then
+                    expected=$here/$name.aot.out
+                fi
+                ;;
+        esac
+        if "$@" < /dev/null > "$work/out" && cmp -s "$work/out" "$expected"; then
+            echo "ok   $name $engine"
+        else
+            echo "FAIL $name $engine"
+            failed=1
+        fi
+    done
+done
+exit $failed
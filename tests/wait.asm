@@ -0,0 +1,19 @@
+; wait: reads the end of input twice through WAIT and KBDR. With no timer
+; running, WAIT must return instead of sleeping forever after EOF.
+.ORIG x3000
+        LD R2, TWO
+LOOP    TRAP x26            ; WAIT
+        LDI R0, KBSR
+        LDI R0, KBDR
+        ADD R0, R0, #1      ; xFFFF is the end of input
+        BRnp LOOP
+        ADD R2, R2, #-1
+        BRp LOOP
+        LEA R0, DONE
+        PUTS
+        HALT
+TWO     .FILL #2
+KBSR    .FILL xFE00
+KBDR    .FILL xFE02
+DONE    .STRINGZ "EOF twice\n"
+.END